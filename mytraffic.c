@@ -5,14 +5,46 @@
 #include <linux/fs.h>
 #include <linux/errno.h>
 #include <linux/uaccess.h>
-#include <linux/timer.h>
-#include <linux/jiffies.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
 #include <linux/proc_fs.h>
 #include <linux/seq_file.h>
 #include <linux/sched.h>
 #include <linux/types.h>
 #include <linux/gpio.h>
+#include <linux/gpio/consumer.h>
 #include <linux/interrupt.h>
+#include <linux/spinlock.h>
+#include <linux/seqlock.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/mm.h>
+#include <linux/string.h>
+#include <linux/err.h>
+#include <linux/atomic.h>
+#include <linux/sort.h>
+#include <linux/pwm.h>
+#include <linux/workqueue.h>
+#include <linux/mutex.h>
+#include <linux/debugfs.h>
+#include <linux/time.h>
+#include <linux/ctype.h>
+#include <linux/gcd.h>
+#include <linux/sched/types.h>
+#include <linux/irqdesc.h>
+#include <linux/irq_work.h>
+#include <linux/cpumask.h>
+#include <linux/cdev.h>
+#include <linux/device.h>
+#include <linux/rcupdate.h>
+
+#include "mytraffic.h"
+#include "mytraffic_fsm.h"
+#include "mytraffic_grid.h"
+
+#define CREATE_TRACE_POINTS
+#include "mytraffic_trace.h"
 
 /* Traffic Light module: mytraffic */
 MODULE_LICENSE("GPL");
@@ -26,36 +58,362 @@ MODULE_DESCRIPTION("Linux traffic light module");
 #define TOGGLE_BTN 26 /* To switch modes...to be implemented later */
 #define PED_BTN 46 /* Pedestrian crossing button */
 
-/* TRAFFIC LIGHT MODES:
-    Normal: Green -> Green -> Green -> Yellow -> Red -> Red ->
-    Flashing Red: Red -> Off -> Red -> Off ->
-    FLashing Yellow: Yellow -> Off -> Yellow -> Off ->
-*/
-enum mode {
-    NORMAL,
-    FLASHING_RED,
-    FLASHING_YELLOW
+/* Signal heads: light n drives the lamps on red_gpio[n], yellow_gpio[n] and
+    green_gpio[n] and is minor n of the character device. Buttons are
+    optional; -1 leaves a light without one. The defaults are one light on
+    the pins above. */
+#define MAX_LIGHTS 8
+static int red_gpio[MAX_LIGHTS] = { RED };
+static int yellow_gpio[MAX_LIGHTS] = { YELLOW };
+static int green_gpio[MAX_LIGHTS] = { GREEN };
+static int toggle_gpio[MAX_LIGHTS] = { TOGGLE_BTN, -1, -1, -1, -1, -1, -1, -1 };
+static int ped_gpio[MAX_LIGHTS] = { PED_BTN, -1, -1, -1, -1, -1, -1, -1 };
+static unsigned int nr_lights = 1;
+static unsigned int nr_yellow = 1;
+static unsigned int nr_green = 1;
+module_param_array(red_gpio, int, &nr_lights, 0444);
+MODULE_PARM_DESC(red_gpio, "Red lamp GPIO of each light; sets the number of lights");
+module_param_array(yellow_gpio, int, &nr_yellow, 0444);
+MODULE_PARM_DESC(yellow_gpio, "Yellow lamp GPIO of each light");
+module_param_array(green_gpio, int, &nr_green, 0444);
+MODULE_PARM_DESC(green_gpio, "Green lamp GPIO of each light");
+module_param_array(toggle_gpio, int, NULL, 0444);
+MODULE_PARM_DESC(toggle_gpio, "Mode toggle button GPIO of each light, -1 for none");
+module_param_array(ped_gpio, int, NULL, 0444);
+MODULE_PARM_DESC(ped_gpio, "Pedestrian button GPIO of each light, -1 for none");
+
+/* Conflict monitoring: inputs wired back to a light's lamp outputs. With all
+    three set, every lamp change is read back right after the write, one bank
+    read when the inputs share a controller, and after verify_limit
+    mismatches in a row the light latches to flashing red until "clear-fault"
+    is written to it. -1 leaves a light unchecked. */
+static int sense_red_gpio[MAX_LIGHTS] = { -1, -1, -1, -1, -1, -1, -1, -1 };
+static int sense_yellow_gpio[MAX_LIGHTS] = { -1, -1, -1, -1, -1, -1, -1, -1 };
+static int sense_green_gpio[MAX_LIGHTS] = { -1, -1, -1, -1, -1, -1, -1, -1 };
+module_param_array(sense_red_gpio, int, NULL, 0444);
+MODULE_PARM_DESC(sense_red_gpio, "Input reading back each light's red output, -1 for none");
+module_param_array(sense_yellow_gpio, int, NULL, 0444);
+MODULE_PARM_DESC(sense_yellow_gpio, "Input reading back each light's yellow output, -1 for none");
+module_param_array(sense_green_gpio, int, NULL, 0444);
+MODULE_PARM_DESC(sense_green_gpio, "Input reading back each light's green output, -1 for none");
+static unsigned int verify_limit = 3;
+module_param(verify_limit, uint, 0444);
+MODULE_PARM_DESC(verify_limit, "Readback mismatches in a row before flashing red (default 3)");
+
+/* PWM channels (legacy pwm_request() ids) that can also drive a light's
+    lamps. A plan that only blinks one lamp, like the flashing modes, is handed
+    to that lamp's channel and runs without waking the CPU; the GPIO is held
+    off meanwhile. -1 leaves blinking to the timer. */
+static int red_pwm[MAX_LIGHTS] = { -1, -1, -1, -1, -1, -1, -1, -1 };
+static int yellow_pwm[MAX_LIGHTS] = { -1, -1, -1, -1, -1, -1, -1, -1 };
+static int green_pwm[MAX_LIGHTS] = { -1, -1, -1, -1, -1, -1, -1, -1 };
+module_param_array(red_pwm, int, NULL, 0444);
+MODULE_PARM_DESC(red_pwm, "PWM channel driving each light's red lamp, -1 for none");
+module_param_array(yellow_pwm, int, NULL, 0444);
+MODULE_PARM_DESC(yellow_pwm, "PWM channel driving each light's yellow lamp, -1 for none");
+module_param_array(green_pwm, int, NULL, 0444);
+MODULE_PARM_DESC(green_pwm, "PWM channel driving each light's green lamp, -1 for none");
+
+/* Timer slack per mode: how late a state change may come so the kernel can
+    fold our wakeup into others and let the CPU idle longer. 0 is exact.
+    Changed per light with MYTRAFFIC_IOC_SET_SLACK. */
+#define MAX_SLACK_US 100000
+static unsigned int slack_us[NUM_MODES];
+module_param_array(slack_us, uint, NULL, 0444);
+MODULE_PARM_DESC(slack_us, "Timer slack in us for normal, flashing-red and flashing-yellow (default 0,0,0)");
+
+/* Green wave: with corridor set, every light runs on one master cycle grid
+    at corridor_rate, light n's plan lagging the master by offset_ticks[n]
+    cycles. After a crossing or a mode change a light rejoins the corridor
+    at the point of its plan the master cycle dictates rather than at phase 0. */
+static bool corridor;
+module_param(corridor, bool, 0444);
+MODULE_PARM_DESC(corridor, "Coordinate all lights on one master cycle (default off)");
+static unsigned int corridor_rate = 1;
+module_param(corridor_rate, uint, 0444);
+MODULE_PARM_DESC(corridor_rate, "Master cycle rate in Hz for corridor mode (default 1)");
+static unsigned int offset_ticks[MAX_LIGHTS];
+module_param_array(offset_ticks, uint, NULL, 0444);
+MODULE_PARM_DESC(offset_ticks, "Phase offset of each light behind the master cycle, in cycles");
+
+/* Debounce: a rising edge arms a settle timer; bounces while it runs are
+    dropped in the hard IRQ, and the press counts if the pin is still high when
+    it expires. Controllers with hardware debounce filter the edges instead. */
+#define MAX_DEBOUNCE_US 1000000
+static unsigned int debounce_us = 20000;
+module_param(debounce_us, uint, 0444);
+MODULE_PARM_DESC(debounce_us, "Button settle time in microseconds (default 20000)");
+static bool hw_debounce = true;
+module_param(hw_debounce, bool, 0444);
+MODULE_PARM_DESC(hw_debounce, "Use the GPIO controller's debounce filter where available (default on)");
+
+/* Real-time placement, for an RT kernel under load from other IRQ threads.
+    irq_prio runs the button IRQ threads at that SCHED_FIFO priority (or
+    SCHED_RR with irq_policy=rr) instead of the kernel's default, irq_cpu
+    steers the button IRQs and their threads to one CPU, and timer_cpu keeps
+    the shared timer base on one CPU, kicks from other CPUs being handed to
+    it with an irq_work. 0 and -1 leave the kernel's choice. */
+static int irq_prio;
+module_param(irq_prio, int, 0444);
+MODULE_PARM_DESC(irq_prio, "RT priority of the button IRQ threads, 1-99 (default 0: kernel default)");
+static char *irq_policy = "fifo";
+module_param(irq_policy, charp, 0444);
+MODULE_PARM_DESC(irq_policy, "Scheduling policy for irq_prio: fifo or rr (default fifo)");
+static int irq_cpu = -1;
+module_param(irq_cpu, int, 0444);
+MODULE_PARM_DESC(irq_cpu, "CPU the button IRQs are steered to (default -1: any)");
+static int timer_cpu = -1;
+module_param(timer_cpu, int, 0444);
+MODULE_PARM_DESC(timer_cpu, "CPU the timer base runs on (default -1: any)");
+
+/* Early pedestrian service: with early_ped set, a pending request cuts the
+    green phase it arrives in short, to min_green cycles from the start of
+    the phase (or ends it on the next cycle if that many have already run).
+    This and the adaptive parameters below are only the values the module
+    loads with; /proc/mytraffic/config changes them at runtime. */
+static bool early_ped;
+module_param(early_ped, bool, 0444);
+MODULE_PARM_DESC(early_ped, "Shorten green when a pedestrian is waiting (default off)");
+static unsigned int min_green = 1;
+module_param(min_green, uint, 0444);
+MODULE_PARM_DESC(min_green, "Shortest green in cycles under early_ped (default 1)");
+
+/* Adaptive timing: with adaptive set, each light counts the pedestrian
+    requests it took in the last adapt_window seconds and scales its green
+    and crossing phases between the idle and busy end of their bounds, in
+    percent of the plan: idle, greens run adapt_green[1] and crossings
+    adapt_cross[0]; from adapt_busy requests on, greens run adapt_green[0]
+    and crossings adapt_cross[1]. Corridor lights keep their plans. */
+#define PED_ARRIVALS 32
+#define MAX_ADAPT_PCT 1000
+static bool adaptive;
+module_param(adaptive, bool, 0444);
+MODULE_PARM_DESC(adaptive, "Scale green and crossing phases by pedestrian demand (default off)");
+static unsigned int adapt_window = 120;
+module_param(adapt_window, uint, 0444);
+MODULE_PARM_DESC(adapt_window, "Seconds of requests adaptive timing looks back over (default 120)");
+static unsigned int adapt_busy = 10;
+module_param(adapt_busy, uint, 0444);
+MODULE_PARM_DESC(adapt_busy, "Requests in the window that count as busy, up to 32 (default 10)");
+static unsigned int adapt_green[2] = { 50, 200 };
+module_param_array(adapt_green, uint, NULL, 0444);
+MODULE_PARM_DESC(adapt_green, "Green length in percent when busy,idle (default 50,200)");
+static unsigned int adapt_cross[2] = { 100, 200 };
+module_param_array(adapt_cross, uint, NULL, 0444);
+MODULE_PARM_DESC(adapt_cross, "Crossing length in percent when idle,busy (default 100,200)");
+
+/* Tunables the timer and IRQ paths read, published through RCU. A write to
+    /proc/mytraffic/config builds a whole new set and swaps the pointer, so
+    readers never wait and never see half of one change; each light picks
+    the new timing up on its next step or pedestrian request. */
+struct traffic_config {
+    unsigned int debounce_us;
+    unsigned int early_ped; // 0 or 1
+    unsigned int min_green;
+    unsigned int adaptive; // 0 or 1
+    unsigned int adapt_window;
+    unsigned int adapt_busy;
+    unsigned int adapt_green[2];
+    unsigned int adapt_cross[2];
+    struct rcu_head rcu;
+};
+
+struct traffic_light;
+
+/* Push-button input */
+struct traffic_button {
+    struct traffic_light *light;
+    int gpio; // -1 if the light has no such button
+    int irq; // Interrupt request number
+    bool hw_debounce; // Controller filters bounces, no settle timer needed
+    struct hrtimer settle; // Software debounce window
+    void (*pressed)(struct traffic_light *light); // Runs in the IRQ thread
+    unsigned long presses; // Edges that made it through debounce
+    unsigned long dropped; // Edges discarded as bounces
+};
+
+/* Running totals of one light, kept under its state lock and read through
+    it without blocking the timer. Dwell times cover completed intervals;
+    the one in progress is from the matching _since to now. */
+struct traffic_counters {
+    u64 cycles; // Cycles stepped through
+    u64 mode_ns[NUM_MODES]; // Time spent in each mode
+    u64 lamp_ns[1 << NUM_LAMPS]; // Time spent showing each LAMP_* combination
+    ktime_t mode_since;
+    ktime_t lamps_since;
+    unsigned long ped_requests; // Requests accepted, repeats included
+    unsigned long crossings; // Crossings started
+    unsigned long rate_changes;
+    unsigned long verified; // Lamp changes read back
+    unsigned long mismatched; // Of those, ones that differed
+};
+
+/* When the last PED_ARRIVALS new pedestrian requests were made */
+struct ped_arrivals {
+    unsigned int count; // Total recorded; the newest is at[(count - 1) % PED_ARRIVALS]
+    ktime_t at[PED_ARRIVALS];
+};
+
+/* The last PED_SAMPLES durations of one kind, for percentiles */
+#define PED_SAMPLES 128
+struct ped_samples {
+    unsigned int count; // Total recorded; the newest is ns[(count - 1) % PED_SAMPLES]
+    u64 ns[PED_SAMPLES];
+};
+
+/* Per-value sysfs attributes of a light, in mytraffic_attrs[] order */
+enum {
+    ATTR_MODE,
+    ATTR_RATE,
+    ATTR_LAMPS,
+    ATTR_PED_STATE,
+    NUM_ATTRS
 };
 
 /* Traffic Light State */
 struct traffic_light {
-    enum mode current_mode;
-    struct timer_list timer;
-    int cycle_count;
-    int ped_cycle_count;
-    unsigned int rate;
-    bool red_active;
-    bool yellow_active;
-    bool green_active;
-    bool ped_requested; // Pedestrian crossing requested
-    bool ped_crossing; // Pedestrian crossing in progress
-    int irq_toggle; // Interrupt request number
-    int irq_ped;
+    unsigned int index; // Minor number and slot in lights[]
+    struct traffic_fsm fsm; // Mode, plans and position in them, see mytraffic_fsm.h
+    ktime_t next_event; // Deadline of the next state change on the timer base
+    struct traffic_grid grid; // Ticks next_event is laid out on, see mytraffic_grid.h
+    bool corridor; // Runs on the master grid, scheduled through the wheel
+    unsigned int offset; // Cycles this light lags the master cycle
+    u64 wheel_tick; // Master tick next_event falls on, if corridor
+    seqlock_t lock; // Serializes the timer, IRQ handlers and writers; readers retry
+    unsigned int generation; // Bumped on every change of the reported state
+    wait_queue_head_t wq; // Readers and pollers waiting for the next generation
+    struct mytraffic_shared *shared; // Page user space can mmap
+    unsigned int rate_mhz; // Cycle rate in mHz
+    u8 lamps; // LAMP_* bits currently lit
+    int lamp_gpio[NUM_LAMPS]; // RED, YELLOW, GREEN in LAMP_* bit order
+    struct gpio_desc *lamp_desc[NUM_LAMPS];
+    bool lamps_one_bank; // All lamps on one GPIO controller, switched in one write
+    int sense_gpio[NUM_LAMPS]; // Readback inputs in LAMP_* bit order, -1 if unchecked
+    struct gpio_desc *sense_desc[NUM_LAMPS];
+    bool verify; // Lamp changes are read back through sense_desc
+    unsigned int mismatches; // Readbacks in a row that differed from the lamps written
+    bool lamp_fault; // Latched after verify_limit mismatches: held in flashing red
+    unsigned int slack_us[NUM_MODES]; // Lateness each mode tolerates, for batching
+    struct pwm_device *lamp_pwm[NUM_LAMPS]; // PWM wired to each lamp, or NULL
+    u8 pwm_lamps; // LAMP_* bit blinking on PWM while the timer sleeps, 0 if none
+    unsigned int pwm_period_ns; // Blink timing for pwm_lamps
+    unsigned int pwm_duty_ns;
+    struct work_struct pwm_work; // Applies pwm_lamps; PWM calls may sleep
+    struct pwm_device *pwm_running; // Channel pwm_work last enabled
+    ktime_t ped_requested_at; // When the pending request was first made
+    ktime_t crossing_started_at; // When the running crossing lit its lamps
+    struct ped_samples ped_wait; // Request to crossing start
+    struct ped_samples ped_cross; // Crossing start to completion
+    struct ped_arrivals arrivals; // Demand adaptive timing works from
+    struct mytraffic_program program; // Schedule being run, count 0 if none
+    ktime_t program_base; // Time on program_timer's clock where the program's time 0 falls
+    struct hrtimer program_timer; // Fires on the program's next step
+    struct mutex program_lock; // Serializes uploads, which re-initialize program_timer
+    struct traffic_button toggle_btn;
+    struct traffic_button ped_btn;
+    struct traffic_counters stats;
+    struct device *dev; // Device node and sysfs directory, NULL until registered
+    struct kernfs_node *attr_kn[NUM_ATTRS]; // Attribute files, for sysfs_notify_dirent()
+    unsigned int attr_value[NUM_ATTRS]; // Value each attribute last notified
+};
+
+/* Lamps shown to readers: those lit on GPIO plus one blinking on PWM */
+static inline u8 lit_lamps(const struct traffic_light *light)
+{
+    return light->lamps | light->pwm_lamps;
+}
+
+/* Snapshot of everything mytraffic_read reports, taken in one piece */
+struct traffic_status {
+    unsigned int generation;
+    enum mode mode;
+    unsigned int rate_mhz;
+    u8 lamps;
+    bool ped_requested;
+    bool ped_crossing;
+};
+
+/* Per-open file state */
+#define STATUS_TEXT_LEN 256
+struct traffic_file {
+    struct traffic_light *light; // Instance selected by the minor number
+    unsigned int seen_generation; // Generation last returned by read()
+    struct mutex lock; // Serializes readers of this file over the text below
+    unsigned int format; // MYTRAFFIC_FMT_* read() returns
+    bool text_valid; // text holds the state of text_generation
+    unsigned int text_generation;
+    int text_len;
+    char text[STATUS_TEXT_LEN]; // Formatted once per generation; reads at f_pos > 0 come from here
 };
 
 /* Global variables */
-static int mytraffic_major = 61;
-static struct traffic_light *t_light;
+static dev_t mytraffic_devt; // Major allocated at load, minor 0
+static struct cdev mytraffic_cdev;
+static struct class *mytraffic_class;
+static struct traffic_light *lights[MAX_LIGHTS];
+
+/* Shared timer base: a single hrtimer serves every light, firing at the
+    earliest next_event among them, so lights changing together share one
+    wakeup and adding a light adds no timer */
+static struct hrtimer timebase;
+static DEFINE_SPINLOCK(timebase_lock);
+
+/* Kick waiting to be applied on timer_cpu, protected by timebase_lock. Of
+    several, the one that must fire soonest is kept; the callback re-arms
+    for the rest. */
+static struct irq_work timebase_work;
+static struct {
+    bool pending;
+    ktime_t when;
+    u64 slack_ns;
+} timebase_handoff;
+
+/* Corridor timing wheel, protected by timebase_lock. Bit n of slot t is set
+    when light n changes on a master tick t modulo WHEEL_SLOTS, so each
+    wakeup only visits the lights that change on it. A light sleeping for
+    more than WHEEL_SLOTS ticks costs a spurious visit per revolution. */
+#define WHEEL_SLOTS 64
+static struct {
+    ktime_t epoch; // Master tick 0
+    unsigned int rate; // Master cycle rate in Hz
+    u64 served; // Last master tick the timer base handled
+    unsigned long slot[WHEEL_SLOTS];
+} wheel;
+
+/* Event ring behind /proc/mytraffic/events. Producers on any CPU claim a
+    slot with one atomic increment and publish it through its seq, so the
+    hot path never waits on a reader or another producer. seq is 1 + the
+    event's index once the slot is complete and 0 while it is being filled. */
+#define EVENT_RING_SIZE 256
+static struct event_slot {
+    unsigned int seq;
+    struct mytraffic_event ev;
+} event_ring[EVENT_RING_SIZE];
+static atomic_t event_head; // Index of the next event
+static struct proc_dir_entry *proc_dir;
+
+/* Lateness of the timer base: how long after its deadline each callback ran.
+    Bucket 0 counts on-time wakeups and bucket n those 2^(n-1) to 2^n - 1 ns
+    late. Cleared by writing to /proc/mytraffic/latency. */
+#define LATENCY_BUCKETS 32
+static struct {
+    u64 samples;
+    u64 sum_ns;
+    u64 min_ns;
+    u64 max_ns;
+    u64 bucket[LATENCY_BUCKETS];
+} latency;
+static DEFINE_SPINLOCK(latency_lock);
+static struct dentry *debug_dir;
+
+/* Configuration in effect; replaced under config_lock, freed after a grace
+    period */
+static struct traffic_config __rcu *config;
+static DEFINE_MUTEX(config_lock); // Serializes config and lamp pin changes
+
+static bool events = true;
+module_param(events, bool, 0644);
+MODULE_PARM_DESC(events, "Record events in /proc/mytraffic/events (default 1)");
 
 /* Function Declarations */
 static int mytraffic_init(void);
@@ -64,389 +422,3063 @@ static int mytraffic_open(struct inode *inode, struct file *filp);
 static ssize_t mytraffic_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos);
 static int mytraffic_release(struct inode *inode, struct file *filp);
 static ssize_t mytraffic_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos);
-static void timer_callback(struct timer_list *t);
+static __poll_t mytraffic_poll(struct file *filp, poll_table *wait);
+static int mytraffic_mmap(struct file *filp, struct vm_area_struct *vma);
+static enum hrtimer_restart timer_callback(struct hrtimer *t);
+static void reschedule_next_tick(struct traffic_light *light, unsigned int stride);
+static void timebase_kick(ktime_t when, u64 slack_ns);
+static void set_rate_locked(struct traffic_light *light, unsigned int rate_mhz);
+static void set_mode_locked(struct traffic_light *light, enum mode mode);
+static int load_program(struct traffic_light *light, const struct mytraffic_program *prog);
+static int set_lamp_pins(struct traffic_light *light, const int gpio[NUM_LAMPS]);
+static long mytraffic_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
+static ssize_t events_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos);
+static int latency_open(struct inode *inode, struct file *filp);
+static int ped_stats_open(struct inode *inode, struct file *filp);
+static ssize_t ped_stats_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos);
+static int counters_open(struct inode *inode, struct file *filp);
+static ssize_t latency_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos);
+static int config_open(struct inode *inode, struct file *filp);
+static int state_open(struct inode *inode, struct file *filp);
+static ssize_t state_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos);
+static ssize_t config_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos);
 
 /* File operations */
 /* Additional feature: add mytimer_write to write new rate from user space */
 static struct file_operations mytraffic_fops = {
     owner: THIS_MODULE,
+    llseek: default_llseek,
     read: mytraffic_read,
     write: mytraffic_write,
+    poll: mytraffic_poll,
+    mmap: mytraffic_mmap,
+    unlocked_ioctl: mytraffic_ioctl,
+    compat_ioctl: mytraffic_ioctl,
     open: mytraffic_open,
     release: mytraffic_release
 };
 
+static const struct file_operations events_fops = {
+    owner: THIS_MODULE,
+    llseek: default_llseek,
+    read: events_read
+};
+
+static const struct file_operations latency_fops = {
+    owner: THIS_MODULE,
+    open: latency_open,
+    read: seq_read,
+    write: latency_write,
+    llseek: seq_lseek,
+    release: single_release
+};
+
+static const struct file_operations ped_stats_fops = {
+    owner: THIS_MODULE,
+    open: ped_stats_open,
+    read: seq_read,
+    write: ped_stats_write,
+    llseek: seq_lseek,
+    release: single_release
+};
+
+static const struct file_operations config_fops = {
+    owner: THIS_MODULE,
+    open: config_open,
+    read: seq_read,
+    write: config_write,
+    llseek: seq_lseek,
+    release: single_release
+};
+
+static const struct file_operations state_fops = {
+    owner: THIS_MODULE,
+    open: state_open,
+    read: seq_read,
+    write: state_write,
+    llseek: seq_lseek,
+    release: single_release
+};
+
+static const struct file_operations counters_fops = {
+    owner: THIS_MODULE,
+    open: counters_open,
+    read: seq_read,
+    llseek: seq_lseek,
+    release: single_release
+};
+
 /* Init/Exit functions */
 module_init(mytraffic_init);
 module_exit(mytraffic_exit);
 
 static int mytraffic_open(struct inode *inode, struct file *filp)
 {
+    unsigned int minor = iminor(inode);
+    struct traffic_file *tf;
+
+    if (minor >= nr_lights || !lights[minor]) {
+        return -ENXIO;
+    }
+    tf = kzalloc(sizeof(*tf), GFP_KERNEL);
+    if (!tf) {
+        return -ENOMEM;
+    }
+    tf->light = lights[minor];
+    mutex_init(&tf->lock);
+    /* The current state counts as unseen, so the first read never blocks */
+    tf->seen_generation = READ_ONCE(tf->light->generation) - 1;
+    filp->private_data = tf;
 	return 0;
 }
 
 static int mytraffic_release(struct inode *inode, struct file *filp)
 {
+    kfree(filp->private_data);
 	return 0;
 }
 
-/* mytraffic_read (below) NEEDS TO BE COMPLETED per LAB REQUIREMENTS */
-/* Readable Character Device:
+/* Rewrite the mmap-able status page. Writers are serialized by the state
+    lock, so a bare sequence count is enough for user space to detect a
+    torn sample. */
+static void update_shared_page(struct traffic_light *light)
+{
+    struct mytraffic_shared *sh = light->shared;
 
-    Your module should set up a character device at /dev/mytraffic that returns the following information when read:
-    (e.g., using cat /dev/mytraffic):
-        Current operational mode (i.e., “normal”, “flashing-red”, or “flashing-yellow”)
-        Current cycle rate (e.g., “1 Hz”, “2 Hz”, etc.)
-        Current status of each light (e.g., “red off, yellow off, green on”)
-        Whether or not a pedestrian is “present” (i.e., currently crossing or waiting to cross after pressing the call button)
- */
-static ssize_t mytraffic_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos)
+    WRITE_ONCE(sh->seq, sh->seq + 1);
+    smp_wmb();
+    sh->generation = light->generation;
+    sh->mode = light->fsm.current_mode;
+    sh->rate = light->rate_mhz / 1000;
+    sh->rate_mhz = light->rate_mhz;
+    sh->lamps = lit_lamps(light);
+    sh->ped_requested = light->fsm.ped_requested;
+    sh->ped_crossing = light->fsm.ped_crossing;
+    sh->plan = light->fsm.plan;
+    sh->phase = light->fsm.phase;
+    sh->phase_elapsed = light->fsm.phase_elapsed;
+    sh->cycle_count = light->fsm.cycle_count;
+    sh->timestamp_ns = ktime_get_ns();
+    smp_wmb();
+    WRITE_ONCE(sh->seq, sh->seq + 1);
+}
+
+/* Pedestrian state as the ped_state attribute reports it */
+static const char * const ped_state_names[] = { "none", "waiting", "crossing" };
+
+static unsigned int ped_state(bool requested, bool crossing)
 {
-	    char kbuf[256];
-    int len = 0;
-    int result;
+    return crossing ? 2 : requested ? 1 : 0;
+}
+
+/* Current value behind each sysfs attribute; caller holds the state lock */
+static void attr_values(struct traffic_light *light, unsigned int value[NUM_ATTRS])
+{
+    value[ATTR_MODE] = light->fsm.current_mode;
+    value[ATTR_RATE] = light->rate_mhz;
+    value[ATTR_LAMPS] = lit_lamps(light);
+    value[ATTR_PED_STATE] = ped_state(light->fsm.ped_requested, light->fsm.ped_crossing);
+}
 
-    /* Prepare status string */
-    len += snprintf(kbuf + len, sizeof(kbuf) - len,
-                    "Mode: %s\n",
-                    (t_light->current_mode == NORMAL) ? "normal" :
-                    (t_light->current_mode == FLASHING_RED) ? "flashing-red" : "flashing-yellow");
-    len += snprintf(kbuf + len, sizeof(kbuf) - len,
-                    "Cycle Rate: %u Hz\n", t_light->rate);
-    len += snprintf(kbuf + len, sizeof(kbuf) - len,
-                    "Lights: red %s, yellow %s, green %s\n",
-                    t_light->red_active ? "on" : "off",
-                    t_light->yellow_active ? "on" : "off",
-                    t_light->green_active ? "on" : "off");
-    len += snprintf(kbuf + len, sizeof(kbuf) - len,
-                    "Pedestrian: %s\n",
-                    (t_light->ped_requested || t_light->ped_crossing) ? "present" : "not present");
+/* Called with the state lock held whenever something a reader reports changes */
+static void notify_state_change(struct traffic_light *light)
+{
+    unsigned int value[NUM_ATTRS];
+    unsigned int i;
 
-    /* Handle read offset */
-    if (*f_pos >= len) {
-        return 0; // EOF
+    light->generation++;
+    update_shared_page(light);
+    wake_up_interruptible(&light->wq);
+
+    /* Wake pollers of only the attributes whose value moved */
+    attr_values(light, value);
+    for (i = 0; i < NUM_ATTRS; i++) {
+        if (value[i] != light->attr_value[i]) {
+            light->attr_value[i] = value[i];
+            if (light->attr_kn[i]) {
+                sysfs_notify_dirent(light->attr_kn[i]);
+            }
+        }
     }
+}
 
-    /* Adjust count if needed */
-    if (count > len - *f_pos) {
-        count = len - *f_pos;
+/* Append an event to the ring, tagged with the lamps lit at the time.
+    Safe in any context. */
+static void record_event(struct traffic_light *light, u8 type, u32 arg)
+{
+    struct event_slot *slot;
+    unsigned int n;
+
+    if (!READ_ONCE(events)) {
+        return;
     }
+    n = atomic_inc_return(&event_head) - 1;
+    slot = &event_ring[n % EVENT_RING_SIZE];
+    WRITE_ONCE(slot->seq, 0);
+    smp_wmb();
+    slot->ev.timestamp_ns = ktime_get_ns();
+    slot->ev.light = light->index;
+    slot->ev.type = type;
+    slot->ev.lamps = lit_lamps(light);
+    slot->ev.arg = arg;
+    smp_store_release(&slot->seq, n + 1);
+}
 
-    /* Transfer data to user space */
-    if (copy_to_user(buf, kbuf + *f_pos, count)) {
-        return -EFAULT;
+/* Copy out the events from the file offset on. A slot still being filled
+    ends the read early; the next read picks it up. */
+static ssize_t events_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos)
+{
+    struct mytraffic_event batch[16];
+    unsigned int n, head, behind;
+    size_t copied = 0;
+
+    if (*f_pos < 0) {
+        return -EINVAL;
+    }
+    n = div_u64(*f_pos, sizeof(batch[0]));
+    head = atomic_read(&event_head);
+    behind = head - n;
+    if (behind > EVENT_RING_SIZE) {
+        /* Overwritten before we got to them */
+        n += behind - EVENT_RING_SIZE;
+        *f_pos += (loff_t)(behind - EVENT_RING_SIZE) * sizeof(batch[0]);
     }
 
-    *f_pos += count;
-    result = count;
-    return result;
+    while (n != head && count - copied >= sizeof(batch[0])) {
+        unsigned int got = 0;
+        bool stalled = false;
+
+        while (got < ARRAY_SIZE(batch) && n + got != head &&
+               count - copied >= (got + 1) * sizeof(batch[0])) {
+            struct event_slot *slot = &event_ring[(n + got) % EVENT_RING_SIZE];
+
+            if (smp_load_acquire(&slot->seq) != n + got + 1) {
+                stalled = true;
+                break;
+            }
+            batch[got] = slot->ev;
+            smp_rmb();
+            if (READ_ONCE(slot->seq) != n + got + 1) {
+                stalled = true; // Overwritten while we copied it
+                break;
+            }
+            got++;
+        }
+        if (got) {
+            if (copy_to_user(buf + copied, batch, got * sizeof(batch[0]))) {
+                return copied ? copied : -EFAULT;
+            }
+            copied += got * sizeof(batch[0]);
+            *f_pos += got * sizeof(batch[0]);
+            n += got;
+        }
+        if (stalled) {
+            break;
+        }
+    }
+    return copied;
 }
 
-static ssize_t mytraffic_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos)
+/* Account one timer base wakeup that was due at expires */
+static void record_latency(ktime_t expires, ktime_t now)
 {
-    /* Allow user to write new rate as a string representing an integer
-       Valid values between 1 and 9, inclusive */
-    char kbuf[16];
-    unsigned int new_rate;
-    if (count >= sizeof(kbuf)) {
-        return -EINVAL; // Input too long
+    s64 late = ktime_to_ns(ktime_sub(now, expires));
+    u64 ns = late > 0 ? late : 0;
+    unsigned long flags;
+
+    spin_lock_irqsave(&latency_lock, flags);
+    if (!latency.samples || ns < latency.min_ns) {
+        latency.min_ns = ns;
     }
-    if (copy_from_user(kbuf, buf, count)) {
-        return -EFAULT;
+    if (ns > latency.max_ns) {
+        latency.max_ns = ns;
     }
-    kbuf[count] = '\0';
-    if (sscanf(kbuf, "%u", &new_rate) == 1) {
-        if (new_rate >= 1 && new_rate <= 9) {
-            t_light->rate = new_rate;
-            printk(KERN_INFO "mytraffic: Cycle rate updated to %u Hz\n", new_rate);
+    latency.samples++;
+    latency.sum_ns += ns;
+    latency.bucket[min(fls64(ns), LATENCY_BUCKETS - 1)]++;
+    spin_unlock_irqrestore(&latency_lock, flags);
+}
+
+static int latency_show(struct seq_file *m, void *v)
+{
+    u64 bucket[LATENCY_BUCKETS];
+    u64 samples, sum_ns, min_ns, max_ns;
+    unsigned long flags;
+    int last, i;
+
+    spin_lock_irqsave(&latency_lock, flags);
+    samples = latency.samples;
+    sum_ns = latency.sum_ns;
+    min_ns = latency.min_ns;
+    max_ns = latency.max_ns;
+    memcpy(bucket, latency.bucket, sizeof(bucket));
+    spin_unlock_irqrestore(&latency_lock, flags);
+
+    seq_printf(m, "samples: %llu\n", samples);
+    if (!samples) {
+        return 0;
+    }
+    seq_printf(m, "min: %llu ns\nmean: %llu ns\nmax: %llu ns\n",
+               min_ns, div64_u64(sum_ns, samples), max_ns);
+
+    last = LATENCY_BUCKETS - 1;
+    while (last > 0 && !bucket[last]) {
+        last--; // Stop at the highest bucket in use
+    }
+    for (i = 0; i <= last; i++) {
+        u64 lo = i ? 1ULL << (i - 1) : 0;
+
+        if (i == LATENCY_BUCKETS - 1) {
+            seq_printf(m, "%10llu ns and up: %llu\n", lo, bucket[i]);
+        } else {
+            seq_printf(m, "%10llu - %10llu ns: %llu\n", lo, (1ULL << i) - 1, bucket[i]);
         }
     }
-    return count;
+    return 0;
 }
 
-/* Timer callback function */
-static void timer_callback(struct timer_list *t)
-{
-    struct traffic_light *light = from_timer(light, t, timer);
-    int cycle_position; // Position in the current cycle
-
-    /* NORMAL OPERATION */
-    light->cycle_count++;
-
-    switch (light->current_mode) {
-        case NORMAL:
-            /* First check for active pedestrian crossing. If true, ped mode for 5 cycles */
-            if (light->ped_crossing) {
-                /* Logic for pedestrian mode: Red & Yellow lit for 5 cycles */
-                if (light->ped_cycle_count < 5) {
-                    light->red_active = true;
-                    light->yellow_active = true;
-                    light->green_active = false;
-                    light->ped_cycle_count++;
-                    printk(KERN_INFO "mytraffic: Pedestrian crossing in progress (%d/5)\n", light->ped_cycle_count);
-
-                } else { /* Pedestrian Crossing completion -> back to Green */
-                    light->ped_crossing = false;
-                    light->ped_requested = false;
-                    light->ped_cycle_count = 0;
-                    light->cycle_count = 0; // Reset cycle to beginning
-                    printk(KERN_INFO "mytraffic: Pedestrian crossing complete, resuming normal operation\n");
-                    light->red_active = false;
-                    light->yellow_active = false;
-                    light->green_active = true;
-                }
-            } else {
+static int latency_open(struct inode *inode, struct file *filp)
+{
+    return single_open(filp, latency_show, NULL);
+}
 
-                cycle_position = light->cycle_count % 6;
-
-                /* Update state based on cycle position */
-                if (cycle_position == 3) {
-                    /* Yellow Light */
-                    light->red_active = false;
-                    light->yellow_active = true;
-                    light->green_active = false;
-
-                } else if (cycle_position == 4 || cycle_position == 5) {
-                    /* Red Light */
-                    light->red_active = true;
-                    light->yellow_active = false;
-                    light->green_active = false;
-
-                    if (light->ped_requested) {
-                        /* If pedestrian mode requested, this stop cycle given to pedestrian mode */
-                        light->ped_crossing = true;
-                        light->ped_requested = false;
-                        light->ped_cycle_count = 0;
-                        printk(KERN_INFO "mytraffic: Starting pedestrian mode\n");
-
-                        light->yellow_active = true;
-
-                    }
-
-                } else {
-                    /* GREEN LIGHT */
-                    light->red_active = false;
-                    light->yellow_active = false;
-                    light->green_active = true;
-                }
-            }
-            break;
+/* Any write clears the histogram */
+static ssize_t latency_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos)
+{
+    unsigned long flags;
 
-        case FLASHING_RED:
-            light->red_active = (light->cycle_count % 2 == 1);
-            light->yellow_active = false;
-            light->green_active = false;
-            break;
+    spin_lock_irqsave(&latency_lock, flags);
+    memset(&latency, 0, sizeof(latency));
+    spin_unlock_irqrestore(&latency_lock, flags);
+    return count;
+}
 
-        case FLASHING_YELLOW:
-            light->red_active = false;
-            light->yellow_active = (light->cycle_count % 2 == 1);
-            light->green_active = false;
-            break;
+/* Keys of /proc/mytraffic/config: the field of struct traffic_config each
+    sets, how many comma-separated values it takes and their range */
+static const struct {
+    const char *name;
+    size_t offset;
+    unsigned int count;
+    unsigned int min;
+    unsigned int max;
+} config_keys[] = {
+    { "debounce_us", offsetof(struct traffic_config, debounce_us), 1, 0, MAX_DEBOUNCE_US },
+    { "early_ped", offsetof(struct traffic_config, early_ped), 1, 0, 1 },
+    { "min_green", offsetof(struct traffic_config, min_green), 1, 1, UINT_MAX },
+    { "adaptive", offsetof(struct traffic_config, adaptive), 1, 0, 1 },
+    { "adapt_window", offsetof(struct traffic_config, adapt_window), 1, 1, UINT_MAX },
+    { "adapt_busy", offsetof(struct traffic_config, adapt_busy), 1, 1, PED_ARRIVALS },
+    { "adapt_green", offsetof(struct traffic_config, adapt_green), 2, 0, MAX_ADAPT_PCT },
+    { "adapt_cross", offsetof(struct traffic_config, adapt_cross), 2, 0, MAX_ADAPT_PCT },
+};
+
+static unsigned int *config_field(struct traffic_config *cfg, unsigned int key)
+{
+    return (unsigned int *)((char *)cfg + config_keys[key].offset);
+}
+
+/* Configuration the module parameters ask for, pulled into range as they
+    always were */
+static struct traffic_config *config_from_params(void)
+{
+    struct traffic_config *cfg = kzalloc(sizeof(*cfg), GFP_KERNEL);
+    unsigned int *value;
+    unsigned int i, j;
 
+    if (!cfg) {
+        return NULL;
+    }
+    cfg->debounce_us = debounce_us;
+    cfg->early_ped = early_ped;
+    cfg->min_green = min_green;
+    cfg->adaptive = adaptive;
+    cfg->adapt_window = adapt_window;
+    cfg->adapt_busy = adapt_busy;
+    memcpy(cfg->adapt_green, adapt_green, sizeof(cfg->adapt_green));
+    memcpy(cfg->adapt_cross, adapt_cross, sizeof(cfg->adapt_cross));
+    for (i = 0; i < ARRAY_SIZE(config_keys); i++) {
+        value = config_field(cfg, i);
+        for (j = 0; j < config_keys[i].count; j++) {
+            value[j] = clamp(value[j], config_keys[i].min, config_keys[i].max);
+        }
     }
-    /* Set GPIO pins according to state */
-    gpio_set_value(RED, light->red_active);
-    gpio_set_value(YELLOW, light->yellow_active);
-    gpio_set_value(GREEN, light->green_active);
+    return cfg;
+}
+
+/* Settle time the buttons use now */
+static unsigned int config_debounce_us(void)
+{
+    unsigned int us;
 
-    /* Update timer */
-    mod_timer(&light->timer, jiffies + HZ / light->rate);
+    rcu_read_lock();
+    us = rcu_dereference(config)->debounce_us;
+    rcu_read_unlock();
+    return us;
 }
 
-/* Interrupt Request Handler for Toggle Button */
-static irqreturn_t toggle_interrupt_handler(int irq, void *dev_id)
+static int config_show(struct seq_file *m, void *v)
 {
-    struct traffic_light *light = (struct traffic_light *)dev_id;
+    struct traffic_config *cfg;
+    unsigned int i, j;
 
-    /* Debouncing to handle successive button presses */
-    static unsigned long most_recent_interrupt = 0;
-    unsigned long current_interrupt = jiffies;
-    if (current_interrupt - most_recent_interrupt < msecs_to_jiffies(250)) {
-        return IRQ_HANDLED; /* Ignore if within debounce period */
+    mutex_lock(&config_lock);
+    cfg = rcu_dereference_protected(config, lockdep_is_held(&config_lock));
+    for (i = 0; i < ARRAY_SIZE(config_keys); i++) {
+        const unsigned int *value = config_field(cfg, i);
+
+        seq_printf(m, "%s=", config_keys[i].name);
+        for (j = 0; j < config_keys[i].count; j++) {
+            seq_printf(m, j ? ",%u" : "%u", value[j]);
+        }
+        seq_putc(m, '\n');
     }
-    most_recent_interrupt = current_interrupt;
+    mutex_unlock(&config_lock);
+    return 0;
+}
 
-    switch (light->current_mode) {
-        case NORMAL:
-            light->current_mode = FLASHING_RED;
-            printk(KERN_INFO "mytraffic: Switched to FLASHING RED mode\n");
-            break;
-        case FLASHING_RED:
-            light->current_mode = FLASHING_YELLOW;
-            printk(KERN_INFO "mytraffic: Switched to FLASHING YELLOW mode\n");
-            break;
-        case FLASHING_YELLOW:
-            light->current_mode = NORMAL;
-            printk(KERN_INFO "mytraffic: Switched to NORMAL mode\n");
-            break;
+static int config_open(struct inode *inode, struct file *filp)
+{
+    return single_open(filp, config_show, NULL);
+}
+
+/* Parse "key=value[,value]" pairs, separated by white space, into cfg */
+static int parse_config(char *cmd, struct traffic_config *cfg)
+{
+    char *tok, *val, *num;
+    unsigned int *value;
+    unsigned int i, j;
 
+    while ((tok = strsep(&cmd, " \t\n")) != NULL) {
+        if (!*tok) {
+            continue;
+        }
+        val = strchr(tok, '=');
+        if (!val) {
+            return -EINVAL;
+        }
+        *val++ = '\0';
+        for (i = 0; i < ARRAY_SIZE(config_keys); i++) {
+            if (strcmp(tok, config_keys[i].name) == 0) {
+                break;
+            }
+        }
+        if (i == ARRAY_SIZE(config_keys)) {
+            return -EINVAL;
+        }
+        value = config_field(cfg, i);
+        for (j = 0; j < config_keys[i].count; j++) {
+            num = strsep(&val, ",");
+            if (!num || kstrtouint(num, 10, &value[j]) ||
+                value[j] < config_keys[i].min || value[j] > config_keys[i].max) {
+                return -EINVAL;
+            }
+        }
+        if (val) {
+            return -EINVAL; // Too many values
+        }
     }
-    light->cycle_count = 0;
-    return IRQ_HANDLED;
+    return 0;
 }
 
-/* Interrupt request handler for pedestrian button
-    when pressed in NORMAL mode, set the ped_requested flag to true */
-static irqreturn_t ped_interrupt_handler(int irq, void *dev_id)
+/* Hand a new settle time to buttons the controller debounces; one it now
+    refuses falls back to the settle timer, which reads the config itself */
+static void apply_debounce(unsigned int us)
 {
-    struct traffic_light* light = (struct traffic_light *)dev_id;
-    static unsigned long most_recent_interrupt = 0;
-    unsigned long current_interrupt = jiffies;
-    if (current_interrupt - most_recent_interrupt < msecs_to_jiffies(250)) {
-        return IRQ_HANDLED; /* Ignore if within debounce period */
-    }
-    most_recent_interrupt = current_interrupt;
+    struct traffic_button *btn;
+    unsigned int i, j;
 
-    if (light->current_mode == NORMAL) {
-        light->ped_requested = true;
-        printk(KERN_INFO "mytraffic: Pedestrian crossing requested\n");
+    for (i = 0; i < nr_lights; i++) {
+        for (j = 0; j < 2; j++) {
+            btn = j ? &lights[i]->ped_btn : &lights[i]->toggle_btn;
+            if (btn->irq < 0 || !btn->hw_debounce) {
+                continue;
+            }
+            if (gpiod_set_debounce(gpio_to_desc(btn->gpio), us)) {
+                printk(KERN_INFO "mytraffic: GPIO %d using %u us software debounce\n",
+                       btn->gpio, us);
+                WRITE_ONCE(btn->hw_debounce, false);
+            }
+        }
     }
-    return IRQ_HANDLED;
 }
 
-/* Init Function */
-static int mytraffic_init(void) {
+/* One write is one change: the keys it names replace theirs in a copy of
+    the configuration in effect, and the copy is swapped in whole */
+static ssize_t config_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos)
+{
+    struct traffic_config *cfg, *old;
+    char kbuf[256];
     int result;
-    printk(KERN_INFO
-    "mytraffic: Initializing traffic light module\n");
 
-    /* Register the character device */
-    result = register_chrdev(mytraffic_major, "mytraffic", &mytraffic_fops);
-    if (result < 0) {
-        printk(KERN_ALERT
-        "mytraffic: cannot obtain major number %d\n", mytraffic_major);
-        return result;
+    if (count >= sizeof(kbuf)) {
+        return -EINVAL;
     }
-
-    /* Allocate traffic light structure */
-    t_light = kmalloc(sizeof(struct traffic_light), GFP_KERNEL);
-    if (!t_light) {
-        printk(KERN_ALERT
-        "mytraffic: insufficient kernel memory\n");
-        unregister_chrdev(mytraffic_major, "mytraffic");
+    if (copy_from_user(kbuf, buf, count)) {
+        return -EFAULT;
+    }
+    kbuf[count] = '\0';
+    cfg = kmalloc(sizeof(*cfg), GFP_KERNEL);
+    if (!cfg) {
         return -ENOMEM;
     }
 
-    /* Initialize traffic light state */
-    t_light->cycle_count = 0;
-    t_light->rate = 1; // default to 1Hz, add add'l functionality later, time permitting
-    t_light->red_active = false;
-    t_light->yellow_active = false;
-    t_light->green_active = true; // Start with state 0...green light
-    t_light->ped_requested = false;
-    t_light->ped_crossing = false;
-
-    /* Setup GPIO pins */
-    result = gpio_request(RED, "Red");
+    mutex_lock(&config_lock);
+    old = rcu_dereference_protected(config, lockdep_is_held(&config_lock));
+    *cfg = *old;
+    result = parse_config(kbuf, cfg);
     if (result) {
-        printk(KERN_ALERT "mytraffic: Failed to request GPIO %d\n", RED);
-        kfree(t_light);
-        unregister_chrdev(mytraffic_major, "mytraffic");
+        mutex_unlock(&config_lock);
+        kfree(cfg);
         return result;
     }
-    gpio_direction_output(RED, 0);
-
-    result = gpio_request(YELLOW, "Yellow");
-    if (result) {
-        printk(KERN_ALERT "mytraffic: Failed to request GPIO %d\n", YELLOW);
-        gpio_free(RED);
-        kfree(t_light);
-        unregister_chrdev(mytraffic_major, "mytraffic");
-        return result;
+    rcu_assign_pointer(config, cfg);
+    if (cfg->debounce_us != old->debounce_us) {
+        apply_debounce(cfg->debounce_us);
     }
-    gpio_direction_output(YELLOW, 0);
+    mutex_unlock(&config_lock);
+    kfree_rcu(old, rcu);
+    return count;
+}
 
-    result = gpio_request(GREEN, "Green");
-    if (result) {
-        printk(KERN_ALERT "mytraffic: Failed to request GPIO %d\n", GREEN);
-        gpio_free(YELLOW);
-        gpio_free(RED);
-        kfree(t_light);
-        unregister_chrdev(mytraffic_major, "mytraffic");
-        return result;
-    }
-    gpio_direction_output(GREEN, 1); // Start in state 0 with green light on
+/* Close the lamp dwell interval running since lamps_since; caller holds the
+    lock and calls this before anything lit_lamps() reports changes */
+static void account_lamps(struct traffic_light *light)
+{
+    ktime_t now = ktime_get();
 
-    t_light->current_mode = NORMAL;
+    light->stats.lamp_ns[lit_lamps(light)] += ktime_to_ns(ktime_sub(now, light->stats.lamps_since));
+    light->stats.lamps_since = now;
+}
 
-    result = gpio_request(TOGGLE_BTN, "Toggle Button");
-    if (result) {
-        printk(KERN_ALERT "mytraffic: Failed to request GPIO %d\n", TOGGLE_BTN);
-        gpio_free(GREEN);
-        gpio_free(YELLOW);
-        gpio_free(RED);
-        kfree(t_light);
-        unregister_chrdev(mytraffic_major, "mytraffic");
-        return result;
-    }
-    gpio_direction_input(TOGGLE_BTN);
-    printk(KERN_INFO "mytraffic: TOGGLE button GPIO %d requested\n", TOGGLE_BTN);
+/* Same for the mode dwell, before current_mode changes */
+static void account_mode(struct traffic_light *light)
+{
+    ktime_t now = ktime_get();
+
+    light->stats.mode_ns[light->fsm.current_mode] += ktime_to_ns(ktime_sub(now, light->stats.mode_since));
+    light->stats.mode_since = now;
+}
 
-    t_light->irq_toggle = gpio_to_irq(TOGGLE_BTN);
-    result = request_irq(t_light->irq_toggle,
-                         toggle_interrupt_handler,
-                         IRQF_TRIGGER_RISING,
-                         "toggle_button_handler",
-                         (void *)t_light);
+/* debugfs mytraffic/lightN: the counters of one light */
+static int counters_show(struct seq_file *m, void *v)
+{
+    static const char * const lamp_names[1 << NUM_LAMPS] = {
+        "dark", "red", "yellow", "red+yellow", "green", "red+green", "yellow+green", "all"
+    };
+    struct traffic_light *light = m->private;
+    struct traffic_counters c;
+    enum mode mode;
+    u8 lamps;
+    unsigned int seq;
+    ktime_t now;
+    unsigned int i;
 
-    result = gpio_request(PED_BTN, "Pedestrian Button");
-    if (result) {
-        printk(KERN_ALERT "mytraffic: Failed to request GPIO %d\n", PED_BTN);
-        gpio_free(GREEN); gpio_free(YELLOW); gpio_free(RED); gpio_free(TOGGLE_BTN);
-        kfree(t_light);
-        unregister_chrdev(mytraffic_major, "mytraffic");
-        return result;
+    do {
+        seq = read_seqbegin(&light->lock);
+        c = light->stats;
+        mode = light->fsm.current_mode;
+        lamps = lit_lamps(light);
+    } while (read_seqretry(&light->lock, seq));
+    now = ktime_get();
+    c.mode_ns[mode] += ktime_to_ns(ktime_sub(now, c.mode_since));
+    c.lamp_ns[lamps] += ktime_to_ns(ktime_sub(now, c.lamps_since));
+
+    seq_printf(m, "cycles: %llu\n", c.cycles);
+    for (i = 0; i < NUM_MODES; i++) {
+        seq_printf(m, "mode %s: %llu ms\n", plan_names[i], div_u64(c.mode_ns[i], NSEC_PER_MSEC));
+    }
+    for (i = 0; i < ARRAY_SIZE(c.lamp_ns); i++) {
+        if (c.lamp_ns[i]) {
+            seq_printf(m, "lamps %s: %llu ms\n", lamp_names[i], div_u64(c.lamp_ns[i], NSEC_PER_MSEC));
+        }
+    }
+    seq_printf(m, "ped requests: %lu\ncrossings: %lu\nrate changes: %lu\n",
+               c.ped_requests, c.crossings, c.rate_changes);
+    if (light->verify) {
+        seq_printf(m, "lamp readback: %lu checked, %lu mismatched%s\n", c.verified,
+                   c.mismatched, READ_ONCE(light->lamp_fault) ? ", fault" : "");
     }
-    gpio_direction_input(PED_BTN);
-    printk(KERN_INFO "mytraffic: PED button GPIO %d requested\n", PED_BTN);
-    t_light->irq_ped = gpio_to_irq(PED_BTN);
-    result = request_irq(t_light->irq_ped,
-                         ped_interrupt_handler,
-                         IRQF_TRIGGER_RISING,
-                         "ped_button_handler",
-                         (void *)t_light);
+    seq_printf(m, "adaptive: green %u%%, crossing %u%%\n",
+               READ_ONCE(light->fsm.green_pct), READ_ONCE(light->fsm.cross_pct));
+    seq_printf(m, "toggle button: %lu pressed, %lu dropped\n",
+               READ_ONCE(light->toggle_btn.presses), READ_ONCE(light->toggle_btn.dropped));
+    seq_printf(m, "ped button: %lu pressed, %lu dropped\n",
+               READ_ONCE(light->ped_btn.presses), READ_ONCE(light->ped_btn.dropped));
+    return 0;
+}
+
+static int counters_open(struct inode *inode, struct file *filp)
+{
+    return single_open(filp, counters_show, inode->i_private);
+}
+
+/* Release the PWM channels a light holds */
+static void free_pwms(struct traffic_light *light)
+{
+    unsigned int n;
 
+    for (n = 0; n < NUM_LAMPS; n++) {
+        if (light->lamp_pwm[n]) {
+            pwm_free(light->lamp_pwm[n]);
+            light->lamp_pwm[n] = NULL;
+        }
+    }
+}
 
-    timer_setup(&t_light->timer, timer_callback, 0);
-    mod_timer(&t_light->timer, jiffies + t_light->rate);
+/* Claim the PWM channels given for a light's lamps, in LAMP_* bit order */
+static int request_pwms(struct traffic_light *light)
+{
+    const int ids[NUM_LAMPS] = {
+        red_pwm[light->index], yellow_pwm[light->index], green_pwm[light->index]
+    };
+    unsigned int n;
+    int result;
 
-    printk(KERN_INFO "mytraffic: Traffic light module initialized\n");
+    for (n = 0; n < NUM_LAMPS; n++) {
+        if (ids[n] < 0) {
+            continue;
+        }
+        light->lamp_pwm[n] = pwm_request(ids[n], "mytraffic");
+        if (IS_ERR(light->lamp_pwm[n])) {
+            result = PTR_ERR(light->lamp_pwm[n]);
+            light->lamp_pwm[n] = NULL;
+            printk(KERN_ALERT "mytraffic: Failed to request PWM %d\n", ids[n]);
+            free_pwms(light);
+            return result;
+        }
+    }
     return 0;
 }
 
-static void mytraffic_exit(void)
+/* Pedestrian service times: caller holds the light's lock */
+static void add_ped_sample(struct ped_samples *ps, ktime_t from, ktime_t to)
 {
-    printk(KERN_INFO "mytraffic: Cleaning up...\n");
+    ps->ns[ps->count++ % PED_SAMPLES] = ktime_to_ns(ktime_sub(to, from));
+}
 
-    /* Remove timer */
-    del_timer_sync(&t_light->timer);
-    printk(KERN_INFO "mytraffic: Timer stopped\n");
+static int cmp_u64(const void *a, const void *b)
+{
+    u64 x = *(const u64 *)a;
+    u64 y = *(const u64 *)b;
 
-    /* Free the Interrupts */
-    free_irq(t_light->irq_toggle, (void *)t_light);
-    free_irq(t_light->irq_ped, (void *)t_light);
+    return x < y ? -1 : x > y;
+}
 
-    /* Turn off all LEDs */
-    gpio_set_value(RED, 0);
-    gpio_set_value(YELLOW, 0);
-    gpio_set_value(GREEN, 0);
+/* Nearest-rank percentiles of the samples still held, in microseconds */
+static void show_ped_samples(struct seq_file *m, unsigned int index, const char *what,
+                             struct ped_samples *ps)
+{
+    static const unsigned int pct[] = { 50, 90, 99 };
+    unsigned int n = min_t(unsigned int, ps->count, PED_SAMPLES);
+    unsigned int i;
 
-    /* Free the pins */
-    gpio_free(TOGGLE_BTN);
-    gpio_free(PED_BTN);
-    gpio_free(RED);
-    gpio_free(YELLOW);
-    gpio_free(GREEN);
-    printk(KERN_INFO "mytraffic: GPIOs freed\n");
+    seq_printf(m, "light %u %s: n=%u", index, what, ps->count);
+    if (n) {
+        sort(ps->ns, n, sizeof(ps->ns[0]), cmp_u64, NULL);
+        for (i = 0; i < ARRAY_SIZE(pct); i++) {
+            seq_printf(m, " p%u=%llu", pct[i],
+                       div_u64(ps->ns[(pct[i] * n + 99) / 100 - 1], NSEC_PER_USEC));
+        }
+        seq_printf(m, " max=%llu us", div_u64(ps->ns[n - 1], NSEC_PER_USEC));
+    }
+    seq_putc(m, '\n');
+}
 
-    kfree(t_light);
-    t_light = NULL;
-    printk(KERN_INFO "mytraffic: Memory freed\n");
+static int ped_stats_show(struct seq_file *m, void *v)
+{
+    struct ped_samples *ps;
+    unsigned int seq;
+    unsigned int i;
 
-    /* Unregister character device */
-    unregister_chrdev(mytraffic_major, "mytraffic");
-    printk(KERN_INFO "mytraffic: Character device unregistered\n");
-    printk(KERN_INFO "mytraffic: Module unloaded\n");
+    ps = kmalloc_array(2, sizeof(*ps), GFP_KERNEL);
+    if (!ps) {
+        return -ENOMEM;
+    }
+    for (i = 0; i < nr_lights; i++) {
+        struct traffic_light *light = lights[i];
+
+        do {
+            seq = read_seqbegin(&light->lock);
+            ps[0] = light->ped_wait;
+            ps[1] = light->ped_cross;
+        } while (read_seqretry(&light->lock, seq));
+        show_ped_samples(m, i, "wait", &ps[0]);
+        show_ped_samples(m, i, "crossing", &ps[1]);
+    }
+    kfree(ps);
+    return 0;
 }
 
+static int ped_stats_open(struct inode *inode, struct file *filp)
+{
+    return single_open(filp, ped_stats_show, NULL);
+}
+
+/* Any write clears every light's samples */
+static ssize_t ped_stats_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos)
+{
+    unsigned long flags;
+    unsigned int i;
+
+    for (i = 0; i < nr_lights; i++) {
+        write_seqlock_irqsave(&lights[i]->lock, flags);
+        lights[i]->ped_wait.count = 0;
+        lights[i]->ped_cross.count = 0;
+        write_sequnlock_irqrestore(&lights[i]->lock, flags);
+    }
+    return count;
+}
+
+/* Map the status page read-only; it is the only thing at offset 0 */
+static int mytraffic_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    struct traffic_file *tf = filp->private_data;
+
+    if (vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start != PAGE_SIZE) {
+        return -EINVAL;
+    }
+    if (vma->vm_flags & VM_WRITE) {
+        return -EPERM;
+    }
+    vma->vm_flags &= ~VM_MAYWRITE;
+    vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+    return remap_pfn_range(vma, vma->vm_start,
+                           virt_to_phys(tf->light->shared) >> PAGE_SHIFT,
+                           PAGE_SIZE, vma->vm_page_prot);
+}
+
+/* Readable once the state has moved past what this file last read */
+static __poll_t mytraffic_poll(struct file *filp, poll_table *wait)
+{
+    struct traffic_file *tf = filp->private_data;
+    struct traffic_light *light = tf->light;
+
+    poll_wait(filp, &light->wq, wait);
+    if (READ_ONCE(light->generation) != tf->seen_generation) {
+        return EPOLLIN | EPOLLRDNORM;
+    }
+    return 0;
+}
+
+/* mytraffic_read (below) NEEDS TO BE COMPLETED per LAB REQUIREMENTS */
+/* Readable Character Device:
+
+    Your module should set up a character device at /dev/mytraffic that returns the following information when read:
+    (e.g., using cat /dev/mytraffic):
+        Current operational mode (i.e., “normal”, “flashing-red”, or “flashing-yellow”)
+        Current cycle rate (e.g., “1 Hz”, “2 Hz”, etc.)
+        Current status of each light (e.g., “red off, yellow off, green on”)
+        Whether or not a pedestrian is “present” (i.e., currently crossing or waiting to cross after pressing the call button)
+ */
+/* Copy the reported state without ever holding off the timer or IRQ path.
+    Writers bump the sequence count, so a copy that raced one is retried
+    and a mode/lamp combination that never existed is never returned. */
+static void read_status(struct traffic_light *light, struct traffic_status *st)
+{
+    unsigned int seq;
+
+    do {
+        seq = read_seqbegin(&light->lock);
+        st->generation = light->generation;
+        st->mode = light->fsm.current_mode;
+        st->rate_mhz = light->rate_mhz;
+        st->lamps = lit_lamps(light);
+        st->ped_requested = light->fsm.ped_requested;
+        st->ped_crossing = light->fsm.ped_crossing;
+    } while (read_seqretry(&light->lock, seq));
+}
+
+/* Fill the fixed-size binary form of a status snapshot */
+static void fill_state(const struct traffic_status *st, struct mytraffic_state *state)
+{
+    memset(state, 0, sizeof(*state));
+    state->generation = st->generation;
+    state->mode = st->mode;
+    state->rate = st->rate_mhz / 1000;
+    state->rate_mhz = st->rate_mhz;
+    state->lamps = st->lamps;
+    state->ped_requested = st->ped_requested;
+    state->ped_crossing = st->ped_crossing;
+}
+
+/* A rate in mHz as Hz with only the decimals it needs, e.g. "2", "0.5", "12.25" */
+static void format_rate(char *buf, size_t size, unsigned int rate_mhz)
+{
+    unsigned int frac = rate_mhz % 1000;
+
+    if (!frac) {
+        snprintf(buf, size, "%u", rate_mhz / 1000);
+    } else if (frac % 100 == 0) {
+        snprintf(buf, size, "%u.%u", rate_mhz / 1000, frac / 100);
+    } else if (frac % 10 == 0) {
+        snprintf(buf, size, "%u.%02u", rate_mhz / 1000, frac / 10);
+    } else {
+        snprintf(buf, size, "%u.%03u", rate_mhz / 1000, frac);
+    }
+}
+
+/* Render a status snapshot in one of the MYTRAFFIC_FMT_* formats */
+static int format_status(const struct traffic_status *st, unsigned int format,
+                         char *kbuf, size_t size)
+{
+    char rate[16];
+    int len = 0;
+
+    format_rate(rate, sizeof(rate), st->rate_mhz);
+
+    switch (format) {
+        case MYTRAFFIC_FMT_BINARY:
+            BUILD_BUG_ON(sizeof(struct mytraffic_state) > STATUS_TEXT_LEN);
+            fill_state(st, (struct mytraffic_state *)kbuf);
+            return sizeof(struct mytraffic_state);
+        case MYTRAFFIC_FMT_KEYVALUE:
+            return scnprintf(kbuf, size,
+                             "generation=%u mode=%s rate=%s red=%d yellow=%d green=%d "
+                             "ped_requested=%d ped_crossing=%d\n",
+                             st->generation, plan_names[st->mode], rate,
+                             !!(st->lamps & LAMP_RED), !!(st->lamps & LAMP_YELLOW),
+                             !!(st->lamps & LAMP_GREEN), st->ped_requested, st->ped_crossing);
+        case MYTRAFFIC_FMT_JSON:
+            return scnprintf(kbuf, size,
+                             "{\"generation\":%u,\"mode\":\"%s\",\"rate\":%s,"
+                             "\"red\":%s,\"yellow\":%s,\"green\":%s,"
+                             "\"ped_requested\":%s,\"ped_crossing\":%s}\n",
+                             st->generation, plan_names[st->mode], rate,
+                             (st->lamps & LAMP_RED) ? "true" : "false",
+                             (st->lamps & LAMP_YELLOW) ? "true" : "false",
+                             (st->lamps & LAMP_GREEN) ? "true" : "false",
+                             st->ped_requested ? "true" : "false",
+                             st->ped_crossing ? "true" : "false");
+    }
+
+    len += scnprintf(kbuf + len, size - len,
+                     "Mode: %s\n", plan_names[st->mode]);
+    len += scnprintf(kbuf + len, size - len,
+                     "Cycle Rate: %s Hz\n", rate);
+    len += scnprintf(kbuf + len, size - len,
+                     "Lights: red %s, yellow %s, green %s\n",
+                     (st->lamps & LAMP_RED) ? "on" : "off",
+                     (st->lamps & LAMP_YELLOW) ? "on" : "off",
+                     (st->lamps & LAMP_GREEN) ? "on" : "off");
+    len += scnprintf(kbuf + len, size - len,
+                     "Pedestrian: %s\n",
+                     (st->ped_requested || st->ped_crossing) ? "present" : "not present");
+    return len;
+}
+
+/* sysfs: one value per attribute under /sys/class/mytraffic/<node>/, each
+    a few bytes, so a reader that polls one of them is only woken when that
+    value changes */
+static ssize_t mode_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct traffic_status st;
+
+    read_status(dev_get_drvdata(dev), &st);
+    return sprintf(buf, "%s\n", plan_names[st.mode]);
+}
+
+static ssize_t rate_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct traffic_status st;
+    char rate[16];
+
+    read_status(dev_get_drvdata(dev), &st);
+    format_rate(rate, sizeof(rate), st.rate_mhz);
+    return sprintf(buf, "%s\n", rate);
+}
+
+/* Lamps lit, in the letters of a phase plan: e.g. "ry", or "-" for dark */
+static ssize_t lamps_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct traffic_status st;
+
+    read_status(dev_get_drvdata(dev), &st);
+    if (!st.lamps) {
+        return sprintf(buf, "-\n");
+    }
+    return sprintf(buf, "%s%s%s\n", (st.lamps & LAMP_RED) ? "r" : "",
+                   (st.lamps & LAMP_YELLOW) ? "y" : "", (st.lamps & LAMP_GREEN) ? "g" : "");
+}
+
+static ssize_t ped_state_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct traffic_status st;
+
+    read_status(dev_get_drvdata(dev), &st);
+    return sprintf(buf, "%s\n", ped_state_names[ped_state(st.ped_requested, st.ped_crossing)]);
+}
+
+static DEVICE_ATTR_RO(mode);
+static DEVICE_ATTR_RO(rate);
+static DEVICE_ATTR_RO(lamps);
+static DEVICE_ATTR_RO(ped_state);
+
+static struct attribute *mytraffic_attrs[] = {
+    [ATTR_MODE] = &dev_attr_mode.attr,
+    [ATTR_RATE] = &dev_attr_rate.attr,
+    [ATTR_LAMPS] = &dev_attr_lamps.attr,
+    [ATTR_PED_STATE] = &dev_attr_ped_state.attr,
+    NULL
+};
+ATTRIBUTE_GROUPS(mytraffic);
+
+static ssize_t mytraffic_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos)
+{
+    struct traffic_file *tf = filp->private_data;
+    struct traffic_light *light = tf->light;
+    struct traffic_status st;
+    ssize_t result;
+
+    /* A read from the start of a state this file has already seen waits for
+       the next change; the first read after open returns at once, so
+       cat /dev/mytraffic behaves as before */
+    if (*f_pos == 0 && READ_ONCE(light->generation) == tf->seen_generation) {
+        if (filp->f_flags & O_NONBLOCK) {
+            return -EAGAIN;
+        }
+        if (wait_event_interruptible(light->wq,
+                                     READ_ONCE(light->generation) != tf->seen_generation)) {
+            return -ERESTARTSYS;
+        }
+    }
+
+    mutex_lock(&tf->lock);
+
+    /* A read from the start takes a fresh snapshot, formatted only if the
+       state moved since the text was made. The rest of a partial read is
+       served from that same text, so one logical read sees one state. */
+    if (*f_pos == 0 || !tf->text_valid) {
+        read_status(light, &st);
+        if (!tf->text_valid || st.generation != tf->text_generation) {
+            tf->text_len = format_status(&st, tf->format, tf->text, sizeof(tf->text));
+            tf->text_generation = st.generation;
+            tf->text_valid = true;
+        }
+        if (*f_pos == 0) {
+            tf->seen_generation = st.generation;
+        }
+    }
+
+    /* Handle read offset */
+    if (*f_pos >= tf->text_len) {
+        result = 0; // EOF
+        goto out;
+    }
+
+    /* Adjust count if needed */
+    if (count > tf->text_len - *f_pos) {
+        count = tf->text_len - *f_pos;
+    }
+
+    /* Transfer data to user space */
+    if (copy_to_user(buf, tf->text + *f_pos, count)) {
+        result = -EFAULT;
+        goto out;
+    }
+
+    *f_pos += count;
+    result = count;
+out:
+    mutex_unlock(&tf->lock);
+    return result;
+}
+
+/* Parse a phase plan of the form "<plan> <lamps>:<ticks>[p] ..."
+    lamps is any of the letters r, y, g (or "-" for dark), ticks is 1-65535
+    and a trailing p marks a phase where a pending crossing may start.
+    e.g. "normal g:3 y:1 r:2p" is the default NORMAL plan. */
+static int parse_plan(char *cmd, unsigned int *index, struct phase_plan *plan)
+{
+    char *tok;
+    char *name = strsep(&cmd, " \t\n");
+    unsigned int i;
+
+    for (i = 0; i < NUM_PLANS; i++) {
+        if (name && strcmp(name, plan_names[i]) == 0) {
+            break;
+        }
+    }
+    if (i == NUM_PLANS) {
+        return -EINVAL;
+    }
+    *index = i;
+
+    plan->len = 0;
+    while ((tok = strsep(&cmd, " \t\n")) != NULL) {
+        struct phase *ph;
+        char *ticks;
+        unsigned int n;
+        size_t len;
+
+        if (*tok == '\0') {
+            continue;
+        }
+        if (plan->len == MAX_PHASES) {
+            return -E2BIG;
+        }
+        ph = &plan->phases[plan->len];
+        ph->lamps = 0;
+        ph->flags = 0;
+
+        ticks = strchr(tok, ':');
+        if (!ticks) {
+            return -EINVAL;
+        }
+        *ticks++ = '\0';
+        for (; *tok; tok++) {
+            switch (*tok) {
+                case 'r': ph->lamps |= LAMP_RED; break;
+                case 'y': ph->lamps |= LAMP_YELLOW; break;
+                case 'g': ph->lamps |= LAMP_GREEN; break;
+                case '-': break;
+                default: return -EINVAL;
+            }
+        }
+        len = strlen(ticks);
+        if (len && ticks[len - 1] == 'p') {
+            ticks[len - 1] = '\0';
+            if (i != PLAN_CROSSING) {
+                ph->flags |= PHASE_PED;
+            }
+        }
+        if (kstrtouint(ticks, 10, &n) || n < 1 || n > 0xffff) {
+            return -EINVAL;
+        }
+        ph->ticks = n;
+
+        /* Never allow a phase that shows red and green together */
+        if ((ph->lamps & LAMP_RED) && (ph->lamps & LAMP_GREEN)) {
+            return -EINVAL;
+        }
+        plan->len++;
+    }
+    return plan->len ? 0 : -EINVAL;
+}
+
+/* Parse a rate in Hz with up to three decimals, e.g. "2", "0.5" or "12.5",
+    into mHz. Trailing whitespace is allowed. */
+static int parse_rate(const char *s, unsigned int *rate_mhz)
+{
+    unsigned int hz = 0, frac = 0, digits = 0;
+
+    if (!isdigit(*s)) {
+        return -EINVAL;
+    }
+    for (; isdigit(*s); s++) {
+        if (hz > MAX_RATE_MHZ) {
+            return -ERANGE;
+        }
+        hz = hz * 10 + (*s - '0');
+    }
+    if (*s == '.') {
+        for (s++; isdigit(*s); s++) {
+            if (++digits > 3) {
+                return -EINVAL;
+            }
+            frac = frac * 10 + (*s - '0');
+        }
+    }
+    for (; digits < 3; digits++) {
+        frac *= 10;
+    }
+    if (*s && !isspace(*s)) {
+        return -EINVAL;
+    }
+    *rate_mhz = hz * 1000 + frac;
+    return 0;
+}
+
+/* Parse a time as seconds, h:mm or h:mm:ss */
+static int parse_time(char *tok, u32 *secs)
+{
+    char *part;
+    unsigned int n, parts = 0;
+
+    *secs = 0;
+    while ((part = strsep(&tok, ":")) != NULL) {
+        if (kstrtouint(part, 10, &n) || (parts && n > 59) || ++parts > 3) {
+            return -EINVAL;
+        }
+        *secs = *secs * 60 + n;
+    }
+    if (parts == 2) {
+        *secs *= 60; // h:mm
+    }
+    return 0;
+}
+
+/* Parse a schedule program of the form
+    "program [daily | every <time>] <time>=<setting>[,<setting>] ..."
+    where a setting is a mode name or a rate in Hz, e.g.
+    "program daily 6:00=normal,1 7:30=4 9:00=1 22:00=flashing-yellow".
+    The values are checked by load_program(). */
+static int parse_program(char *cmd, struct mytraffic_program *prog)
+{
+    char *tok, *setting;
+    unsigned int i, n;
+
+    memset(prog, 0, sizeof(*prog));
+    while ((tok = strsep(&cmd, " \t\n")) != NULL) {
+        struct mytraffic_step *step;
+        char *settings;
+
+        if (*tok == '\0') {
+            continue;
+        }
+        if (strcmp(tok, "daily") == 0 && prog->count == 0) {
+            prog->flags |= MYTRAFFIC_PROG_DAILY;
+            continue;
+        }
+        if (strcmp(tok, "every") == 0 && prog->count == 0) {
+            do {
+                tok = strsep(&cmd, " \t\n");
+            } while (tok && *tok == '\0');
+            if (!tok || parse_time(tok, &prog->period_s)) {
+                return -EINVAL;
+            }
+            continue;
+        }
+        if (prog->count == MYTRAFFIC_MAX_STEPS) {
+            return -E2BIG;
+        }
+        step = &prog->steps[prog->count];
+
+        settings = strchr(tok, '=');
+        if (!settings) {
+            return -EINVAL;
+        }
+        *settings++ = '\0';
+        if (parse_time(tok, &step->at_s)) {
+            return -EINVAL;
+        }
+        while ((setting = strsep(&settings, ",")) != NULL) {
+            for (i = 0; i < NUM_MODES; i++) {
+                if (strcmp(setting, plan_names[i]) == 0) {
+                    break;
+                }
+            }
+            if (i < NUM_MODES) {
+                step->valid |= MYTRAFFIC_CFG_MODE;
+                step->mode = i;
+            } else if (kstrtouint(setting, 10, &n) == 0) {
+                step->valid |= MYTRAFFIC_CFG_RATE;
+                step->rate = n;
+            } else {
+                return -EINVAL;
+            }
+        }
+        prog->count++;
+    }
+    return 0;
+}
+
+static ssize_t mytraffic_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos)
+{
+    /* Allow user to write new rate as a string representing a number of Hz,
+       with up to three decimals. Valid values between 0.1 and 50, inclusive.
+       A line starting with a plan name loads a new phase table instead,
+       one starting with "program" a schedule program, "pins r,y,g"
+       moves the lamps to other GPIOs, and "clear-fault" releases a light
+       held in flashing red by a lamp readback fault. */
+    struct traffic_file *tf = filp->private_data;
+    struct traffic_light *light = tf->light;
+    char kbuf[256];
+    unsigned int new_rate;
+    unsigned long flags;
+    if (count >= sizeof(kbuf)) {
+        return -EINVAL; // Input too long
+    }
+    if (copy_from_user(kbuf, buf, count)) {
+        return -EFAULT;
+    }
+    kbuf[count] = '\0';
+    if (strncmp(kbuf, "program", 7) == 0 && (kbuf[7] == '\0' || isspace(kbuf[7]))) {
+        struct mytraffic_program prog;
+        int result = parse_program(kbuf + 7, &prog);
+
+        if (!result) {
+            result = load_program(light, &prog);
+        }
+        return result ? result : count;
+    }
+    if (strncmp(kbuf, "pins", 4) == 0 && isspace(kbuf[4])) {
+        int gpio[NUM_LAMPS];
+        int result;
+
+        if (sscanf(kbuf + 5, "%d,%d,%d", &gpio[0], &gpio[1], &gpio[2]) != NUM_LAMPS) {
+            return -EINVAL;
+        }
+        result = set_lamp_pins(light, gpio);
+        return result ? result : count;
+    }
+    if (strncmp(kbuf, "clear-fault", 11) == 0 && (kbuf[11] == '\0' || isspace(kbuf[11]))) {
+        write_seqlock_irqsave(&light->lock, flags);
+        if (light->lamp_fault) {
+            light->lamp_fault = false;
+            light->mismatches = 0;
+            printk(KERN_INFO "mytraffic: Light %u lamp fault cleared\n", light->index);
+        }
+        write_sequnlock_irqrestore(&light->lock, flags);
+        return count;
+    }
+    if (kbuf[0] >= 'a' && kbuf[0] <= 'z') {
+        struct phase_plan plan;
+        unsigned int index;
+        int result = parse_plan(kbuf, &index, &plan);
+
+        if (result) {
+            return result;
+        }
+        write_seqlock_irqsave(&light->lock, flags);
+        if (light->lamp_fault && index == FLASHING_RED) {
+            write_sequnlock_irqrestore(&light->lock, flags);
+            return -EIO; // The plan a faulted light is held in
+        }
+        /* The running plan may have shrunk under us, so start it over */
+        if (fsm_load_plan(&light->fsm, index, &plan)) {
+            reschedule_next_tick(light, 1);
+        }
+        trace_mytraffic_plan(light->index, index, plan.len);
+        record_event(light, MYTRAFFIC_EV_PLAN, index);
+        write_sequnlock_irqrestore(&light->lock, flags);
+        return count;
+    }
+    if (parse_rate(kbuf, &new_rate) == 0) {
+        if (light->corridor) {
+            return -EBUSY; // The corridor's rate is fixed at load
+        }
+        if (new_rate >= MIN_RATE_MHZ && new_rate <= MAX_RATE_MHZ) {
+            write_seqlock_irqsave(&light->lock, flags);
+            set_rate_locked(light, new_rate);
+            write_sequnlock_irqrestore(&light->lock, flags);
+        }
+    }
+    return count;
+}
+
+/* Make sure the timer base fires between when and slack_ns after it.
+    Also used by the base's own callback to re-arm itself: the timer is only
+    requeued if what is queued could fire too late, so a kick that raced the
+    callback is never undone. The range queued is the overlap of the old and
+    new ones where they meet, letting the kernel batch the wakeup with others.
+    With timer_cpu set, a kick made on another CPU is handed to timer_cpu and
+    applied there, so the timer is always queued, and fires, on that CPU.
+    Caller holds timebase_lock. */
+static void timebase_kick_locked(ktime_t when, u64 slack_ns)
+{
+    enum hrtimer_mode mode = timer_cpu >= 0 ? HRTIMER_MODE_ABS_PINNED : HRTIMER_MODE_ABS;
+    ktime_t latest = ktime_add_ns(when, slack_ns);
+    ktime_t soft;
+
+    if (timer_cpu >= 0 && smp_processor_id() != timer_cpu) {
+        if (!timebase_handoff.pending ||
+            ktime_before(latest, ktime_add_ns(timebase_handoff.when, timebase_handoff.slack_ns))) {
+            timebase_handoff.when = when;
+            timebase_handoff.slack_ns = slack_ns;
+        }
+        timebase_handoff.pending = true;
+        irq_work_queue_on(&timebase_work, timer_cpu);
+        return;
+    }
+
+    if (!hrtimer_is_queued(&timebase)) {
+        hrtimer_start_range_ns(&timebase, when, slack_ns, mode);
+    } else if (ktime_before(latest, hrtimer_get_expires(&timebase))) {
+        soft = hrtimer_get_softexpires(&timebase);
+        if (ktime_before(soft, when) || ktime_after(soft, latest)) {
+            soft = when;
+        }
+        hrtimer_start_range_ns(&timebase, soft, ktime_to_ns(ktime_sub(latest, soft)), mode);
+    }
+}
+
+/* Callers may hold a light's lock, never the reverse */
+static void timebase_kick(ktime_t when, u64 slack_ns)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&timebase_lock, flags);
+    timebase_kick_locked(when, slack_ns);
+    spin_unlock_irqrestore(&timebase_lock, flags);
+}
+
+/* Apply a kick handed over from another CPU, on timer_cpu */
+static void timebase_work_fn(struct irq_work *work)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&timebase_lock, flags);
+    if (timebase_handoff.pending) {
+        timebase_handoff.pending = false;
+        timebase_kick_locked(timebase_handoff.when, timebase_handoff.slack_ns);
+    }
+    spin_unlock_irqrestore(&timebase_lock, flags);
+}
+
+/* Master tick a time on the corridor grid falls on (rounded), or the last
+    tick at or before it (floor) */
+static u64 master_tick(ktime_t t, bool round)
+{
+    u64 scaled = (u64)ktime_to_ns(ktime_sub(t, wheel.epoch)) * wheel.rate;
+
+    return div_u64(scaled + (round ? NSEC_PER_SEC / 2 : 0), NSEC_PER_SEC);
+}
+
+/* Absolute deadline of a master tick, on the same exact grid as the lights */
+static ktime_t master_deadline(u64 tick)
+{
+    return ktime_add_ns(wheel.epoch, div_u64(tick * NSEC_PER_SEC, wheel.rate));
+}
+
+/* Queue the timer base for the first occupied wheel slot after the one
+    just served; caller holds timebase_lock */
+static void wheel_arm_locked(void)
+{
+    unsigned int d;
+
+    for (d = 1; d <= WHEEL_SLOTS; d++) {
+        if (wheel.slot[(wheel.served + d) % WHEEL_SLOTS]) {
+            timebase_kick_locked(master_deadline(wheel.served + d), 0);
+            return;
+        }
+    }
+}
+
+/* Timer slack of the light's mode in ns. Corridor lights stay exact. */
+static u64 light_slack(const struct traffic_light *light)
+{
+    return (u64)READ_ONCE(light->slack_us[light->fsm.current_mode]) * NSEC_PER_USEC;
+}
+
+/* Hand a light's new next_event to the timer base; caller holds its lock */
+static void light_armed(struct traffic_light *light)
+{
+    unsigned long flags;
+
+    if (!light->corridor) {
+        timebase_kick(light->next_event, light_slack(light));
+        return;
+    }
+    spin_lock_irqsave(&timebase_lock, flags);
+    __clear_bit(light->index, &wheel.slot[light->wheel_tick % WHEEL_SLOTS]);
+    light->wheel_tick = master_tick(light->next_event, true);
+    __set_bit(light->index, &wheel.slot[light->wheel_tick % WHEEL_SLOTS]);
+    wheel_arm_locked();
+    spin_unlock_irqrestore(&timebase_lock, flags);
+}
+
+/* Set next_event for the next state change, stride cycles after the tick that
+    just fired; see grid_schedule() */
+static void schedule_next_tick(struct traffic_light *light, unsigned int stride)
+{
+    light->next_event = grid_schedule(&light->grid, light->rate_mhz, stride, ktime_get());
+    light_armed(light);
+}
+
+/* Pull next_event in to stride cycles after the last wakeup, or the first
+    grid tick after now if that has passed; caller holds the lock. Used when
+    an event (button press) can change the state sooner than the phase the
+    light is sleeping through. The early wakeup advances the state by the
+    cycles that really went by, as if we had woken on every one. */
+static void reschedule_next_tick(struct traffic_light *light, unsigned int stride)
+{
+    ktime_t now = ktime_get();
+
+    if (light->pwm_lamps) {
+        /* Taking back a blink from PWM: the grid starts over from here */
+        grid_start(&light->grid, now, light->rate_mhz);
+    }
+    light->next_event = grid_reschedule(&light->grid, stride, now);
+    light_armed(light);
+}
+
+/* Read the lamp outputs back and compare them with what was just written;
+    caller holds the lock. The fault is acted on by step_light(). */
+static void verify_lamps(struct traffic_light *light, u8 lamps)
+{
+    int value[NUM_LAMPS] = { 0 }; // A failed read shows as dark
+    unsigned long values = 0;
+    unsigned int i;
+
+    gpiod_get_array_value(NUM_LAMPS, light->sense_desc, value);
+    for (i = 0; i < NUM_LAMPS; i++) {
+        if (value[i] > 0) {
+            values |= BIT(i);
+        }
+    }
+    light->stats.verified++;
+    if (values == lamps) {
+        light->mismatches = 0;
+        return;
+    }
+    light->stats.mismatched++;
+    if (++light->mismatches >= verify_limit && !light->lamp_fault) {
+        light->lamp_fault = true;
+        printk(KERN_ALERT "mytraffic: Light %u lamps read %lx after writing %x, flashing red\n",
+               light->index, values, lamps);
+        record_event(light, MYTRAFFIC_EV_LAMP_FAULT, values << 8 | lamps);
+    }
+}
+
+/* Set all lamp outputs to a LAMP_* bitmask in one gpiod array call (the
+    int-per-line form of the 4.19 kernel the module is built against) */
+static void set_lamp_outputs(struct traffic_light *light, u8 lamps)
+{
+    int value[NUM_LAMPS];
+    unsigned int i;
+
+    for (i = 0; i < NUM_LAMPS; i++) {
+        value[i] = !!(lamps & BIT(i));
+    }
+    gpiod_set_array_value(NUM_LAMPS, light->lamp_desc, value);
+}
+
+/* Drive the lamp GPIOs from a LAMP_* bitmask.
+    gpiolib sets all pins of one controller with a single register write, so
+    when the lamps share a bank the change is atomic. When they don't (the
+    default RED/YELLOW are on gpio2, GREEN on gpio1) a transition that turns
+    lamps both off and on switches the old ones off first: a dark instant is
+    invisible, an instant of red and green together is not. */
+static void write_lamps(struct traffic_light *light, u8 lamps)
+{
+    account_lamps(light);
+    if (!light->lamps_one_bank && (light->lamps & ~lamps) && (lamps & ~light->lamps)) {
+        set_lamp_outputs(light, light->lamps & lamps);
+    }
+    set_lamp_outputs(light, lamps);
+    light->lamps = lamps;
+    if (light->verify) {
+        verify_lamps(light, lamps);
+    }
+}
+
+/* Green a waiting pedestrian cuts a phase down to, 0 unless early_ped */
+static unsigned int early_green(const struct traffic_config *cfg)
+{
+    return cfg->early_ped ? cfg->min_green : 0;
+}
+
+/* Scale the light's green and crossing phases to the requests made in the
+    last adapt_window seconds, or back to the plan when adaptive is off;
+    caller holds the lock */
+static void adapt_timing(struct traffic_light *light, const struct traffic_config *cfg)
+{
+    unsigned int busy = cfg->adapt_busy;
+    ktime_t since = ktime_sub_ns(ktime_get(), (u64)cfg->adapt_window * NSEC_PER_SEC);
+    const struct ped_arrivals *pa = &light->arrivals;
+    const unsigned int *green = cfg->adapt_green, *cross = cfg->adapt_cross;
+    unsigned int n = 0;
+    unsigned int i;
+
+    if (!cfg->adaptive || light->corridor) {
+        fsm_adapt(&light->fsm, 100, 100);
+        return;
+    }
+    for (i = 0; i < min_t(unsigned int, pa->count, PED_ARRIVALS); i++) {
+        if (ktime_after(pa->at[i], since)) {
+            n++;
+        }
+    }
+    n = min(n, busy);
+    fsm_adapt(&light->fsm, (green[1] * (busy - n) + green[0] * n) / busy,
+              (cross[0] * (busy - n) + cross[1] * n) / busy);
+}
+
+/* Hold a light whose lamps failed readback in flashing red, from the step
+    that wrote them; caller holds the lock */
+static void check_lamp_fault(struct traffic_light *light)
+{
+    if (light->lamp_fault && light->fsm.current_mode != FLASHING_RED) {
+        set_mode_locked(light, FLASHING_RED);
+    }
+}
+
+/* Work out PWM timing for the running plan if it is a blink the hardware can
+    take over: one lamp with a channel on, then dark, on a non-corridor light.
+    A blink that serves crossings stays on the timer, which has to be awake
+    to start one. Caller holds the lock. */
+static bool blink_timing(struct traffic_light *light)
+{
+    const struct phase_plan *plan = &light->fsm.plans[light->fsm.plan];
+    u8 on = plan->phases[0].lamps;
+    u64 period;
+
+    if (light->corridor || light->fsm.plan == PLAN_CROSSING || plan->len != 2 ||
+        hweight8(on) != 1 || plan->phases[1].lamps || !light->lamp_pwm[__ffs(on)] ||
+        fsm_serves_ped(plan)) {
+        return false;
+    }
+    period = grid_ticks_ns(plan->phases[0].ticks + plan->phases[1].ticks, light->rate_mhz);
+    if (period > INT_MAX) {
+        return false; // Longer than pwm_config() can express
+    }
+    light->pwm_period_ns = period;
+    light->pwm_duty_ns = grid_ticks_ns(plan->phases[0].ticks, light->rate_mhz);
+    return true;
+}
+
+/* Bring the PWM channels in line with pwm_lamps, in process context */
+static void pwm_work_fn(struct work_struct *work)
+{
+    struct traffic_light *light = container_of(work, struct traffic_light, pwm_work);
+    struct pwm_device *pwm = NULL;
+    unsigned int period_ns, duty_ns;
+    unsigned int seq;
+
+    do {
+        seq = read_seqbegin(&light->lock);
+        if (light->pwm_lamps) {
+            pwm = light->lamp_pwm[__ffs(light->pwm_lamps)];
+        }
+        period_ns = light->pwm_period_ns;
+        duty_ns = light->pwm_duty_ns;
+    } while (read_seqretry(&light->lock, seq));
+
+    if (light->pwm_running && light->pwm_running != pwm) {
+        pwm_disable(light->pwm_running);
+    }
+    light->pwm_running = pwm;
+    if (pwm) {
+        pwm_config(pwm, duty_ns, period_ns);
+        pwm_enable(pwm);
+    }
+}
+
+/* Where in its mode's plan a corridor light belongs on master tick tick */
+static unsigned int corridor_position(struct traffic_light *light, u64 tick)
+{
+    unsigned int cycle = fsm_cycle_len(&light->fsm);
+    u32 pos;
+
+    div_u64_rem(tick + cycle - light->offset % cycle, cycle, &pos);
+    return pos;
+}
+
+/* Advance a light to its next state change; caller holds its lock */
+static void step_light(struct traffic_light *light)
+{
+    struct traffic_fsm *fsm = &light->fsm;
+    const struct traffic_config *cfg;
+    const struct phase *ph;
+    bool was_requested, was_crossing, was_blinking;
+    unsigned int events, early;
+    int resync = -1;
+
+    was_requested = fsm->ped_requested;
+    was_crossing = fsm->ped_crossing;
+    light->stats.cycles += light->grid.stride;
+
+    /* Configuration is taken up here, at a phase boundary */
+    rcu_read_lock();
+    cfg = rcu_dereference(config);
+    early = early_green(cfg);
+    adapt_timing(light, cfg);
+    rcu_read_unlock();
+
+    /* A corridor light rejoins the green wave where the master cycle is now */
+    if (light->corridor) {
+        resync = corridor_position(light, master_tick(grid_deadline(&light->grid), true));
+    }
+    events = fsm_step(fsm, light->grid.stride, resync, early);
+
+    if (events & FSM_CROSSING_END) {
+        add_ped_sample(&light->ped_cross, light->crossing_started_at, ktime_get());
+        trace_mytraffic_ped(light->index, 2);
+        record_event(light, MYTRAFFIC_EV_CROSSING_END, 0);
+    }
+    if (events & FSM_CROSSING_START) {
+        light->crossing_started_at = ktime_get();
+        light->stats.crossings++;
+        add_ped_sample(&light->ped_wait, light->ped_requested_at, light->crossing_started_at);
+        trace_mytraffic_ped(light->index, 1);
+        record_event(light, MYTRAFFIC_EV_CROSSING_START, 0);
+    }
+    ph = fsm_phase(fsm);
+
+    /* A blink starting over is handed to PWM and the timer sleeps until a
+       mode change, write or ioctl takes it back */
+    if (fsm->phase == 0 && fsm->phase_elapsed == 0 && blink_timing(light)) {
+        write_lamps(light, 0);
+        light->pwm_lamps = ph->lamps;
+        schedule_work(&light->pwm_work);
+        notify_state_change(light);
+        trace_mytraffic_state(light->index, fsm->plan, fsm->phase, ph->lamps);
+        record_event(light, MYTRAFFIC_EV_STATE, fsm->plan << 8 | fsm->phase);
+        light->next_event = KTIME_MAX;
+        check_lamp_fault(light);
+        return;
+    }
+    was_blinking = light->pwm_lamps;
+    if (was_blinking) {
+        account_lamps(light);
+        light->pwm_lamps = 0;
+        schedule_work(&light->pwm_work);
+    }
+
+    /* Set GPIO pins according to state, only if the lamps changed */
+    if (ph->lamps != light->lamps || was_blinking) {
+        write_lamps(light, ph->lamps);
+        notify_state_change(light);
+        trace_mytraffic_state(light->index, fsm->plan, fsm->phase, ph->lamps);
+        record_event(light, MYTRAFFIC_EV_STATE, fsm->plan << 8 | fsm->phase);
+    } else if (fsm->ped_requested != was_requested ||
+               fsm->ped_crossing != was_crossing) {
+        notify_state_change(light);
+    } else {
+        update_shared_page(light); // Phase and cycle moved on under the same lamps
+    }
+
+    /* Sleep until the next state change */
+    schedule_next_tick(light, fsm_remaining(fsm, early));
+    check_lamp_fault(light);
+}
+
+/* Deadline a light is waiting for, read without taking its lock */
+static ktime_t light_next_event(struct traffic_light *light)
+{
+    unsigned int seq;
+    ktime_t next;
+
+    do {
+        seq = read_seqbegin(&light->lock);
+        next = light->next_event;
+    } while (read_seqretry(&light->lock, seq));
+    return next;
+}
+
+/* Timer callback function: step every light that is due, then sleep until
+    the earliest remaining deadline, within the slack each light allows */
+static enum hrtimer_restart timer_callback(struct hrtimer *t)
+{
+    ktime_t now = ktime_get();
+    ktime_t due;
+    unsigned long flags;
+    unsigned long wheel_due = 0;
+    unsigned int i;
+
+    record_latency(hrtimer_get_softexpires(t), now);
+
+    /* Corridor lights: collect the ones hashed to the slots that came due */
+    if (corridor) {
+        u64 tick = master_tick(now, false);
+        unsigned int slots;
+
+        spin_lock_irqsave(&timebase_lock, flags);
+        for (slots = 0; slots < WHEEL_SLOTS && wheel.served < tick; slots++) {
+            unsigned long bits = wheel.slot[++wheel.served % WHEEL_SLOTS];
+
+            for_each_set_bit(i, &bits, MAX_LIGHTS) {
+                if (lights[i] && lights[i]->wheel_tick <= tick) {
+                    wheel_due |= BIT(i);
+                }
+            }
+        }
+        wheel.served = tick;
+        spin_unlock_irqrestore(&timebase_lock, flags);
+    }
+
+    for (i = 0; i < nr_lights; i++) {
+        struct traffic_light *light = lights[i];
+
+        if (!light || (light->corridor && !(wheel_due & BIT(i)))) {
+            continue; // Still being set up, or not on this wheel tick
+        }
+        due = light_next_event(light);
+        if (ktime_compare(due, now) <= 0) {
+            write_seqlock_irqsave(&light->lock, flags);
+            if (ktime_compare(light->next_event, now) <= 0) {
+                step_light(light);
+            }
+            due = light->next_event;
+            write_sequnlock_irqrestore(&light->lock, flags);
+        }
+        if (!light->corridor && due != KTIME_MAX) {
+            timebase_kick(due, light_slack(light));
+        }
+    }
+
+    if (corridor) {
+        spin_lock_irqsave(&timebase_lock, flags);
+        wheel_arm_locked();
+        spin_unlock_irqrestore(&timebase_lock, flags);
+    }
+    return HRTIMER_NORESTART;
+}
+
+/* Hard IRQ half for both buttons: only decides whether an edge is a press.
+    With hardware debounce every edge is one; otherwise the first edge starts
+    the settle window and the rest are dropped here at minimal cost */
+static irqreturn_t button_hardirq(int irq, void *dev_id)
+{
+    struct traffic_button *btn = (struct traffic_button *)dev_id;
+
+    if (READ_ONCE(btn->hw_debounce)) {
+        return IRQ_WAKE_THREAD;
+    }
+    if (!hrtimer_active(&btn->settle)) {
+        hrtimer_start(&btn->settle, ns_to_ktime((u64)config_debounce_us() * NSEC_PER_USEC),
+                      HRTIMER_MODE_REL);
+    } else {
+        btn->dropped++;
+    }
+    return IRQ_HANDLED; /* Ignore bounces within debounce period */
+}
+
+/* End of the settle window: a contact still closed is a real press */
+static enum hrtimer_restart button_settled(struct hrtimer *t)
+{
+    struct traffic_button *btn = container_of(t, struct traffic_button, settle);
+
+    if (gpio_get_value(btn->gpio)) {
+        irq_wake_thread(btn->irq, btn);
+    } else {
+        btn->dropped++; // Released again before it settled
+    }
+    return HRTIMER_NORESTART;
+}
+
+/* Threaded IRQ half: act on a debounced press */
+static irqreturn_t button_thread(int irq, void *dev_id)
+{
+    struct traffic_button *btn = (struct traffic_button *)dev_id;
+
+    btn->presses++;
+    trace_mytraffic_button(btn->light->index, btn->gpio);
+    record_event(btn->light, MYTRAFFIC_EV_BUTTON, btn->gpio);
+    btn->pressed(btn->light);
+    return IRQ_HANDLED;
+}
+
+/* Scheduling policy irq_policy names */
+static int irq_sched_policy(void)
+{
+    return strcmp(irq_policy, "rr") == 0 ? SCHED_RR : SCHED_FIFO;
+}
+
+/* Give the button's IRQ thread the irq_prio RT priority. request_irq()
+    makes the thread, at the kernel's default, before it returns, so it is
+    found through the IRQ's actions by its dev_id. */
+static void tune_irq_thread(struct traffic_button *btn)
+{
+    struct irq_desc *desc = irq_to_desc(btn->irq);
+    struct irqaction *action;
+    struct sched_param param;
+
+    param.sched_priority = irq_prio;
+    for (action = desc ? desc->action : NULL; action; action = action->next) {
+        if (action->dev_id == btn && action->thread) {
+            sched_setscheduler_nocheck(action->thread, irq_sched_policy(), &param);
+            printk(KERN_INFO "mytraffic: GPIO %d IRQ thread at %s priority %d\n",
+                   btn->gpio, irq_policy, irq_prio);
+        }
+    }
+}
+
+/* Request a button's IRQ, preferring the controller's debounce filter */
+static int setup_button(struct traffic_light *light, struct traffic_button *btn,
+                        int gpio, const char *name,
+                        void (*pressed)(struct traffic_light *light))
+{
+    int result;
+
+    btn->light = light;
+    btn->gpio = gpio;
+    btn->irq = -1;
+    btn->pressed = pressed;
+    hrtimer_init(&btn->settle, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    btn->settle.function = button_settled;
+    if (gpio < 0) {
+        return 0; // Light has no such button
+    }
+
+    /* The pin came with the light's others, in request_pins() */
+    btn->hw_debounce = hw_debounce &&
+                       gpiod_set_debounce(gpio_to_desc(gpio), config_debounce_us()) == 0;
+    if (!btn->hw_debounce) {
+        printk(KERN_INFO "mytraffic: GPIO %d using %u us software debounce\n", gpio,
+               config_debounce_us());
+    }
+
+    result = gpio_to_irq(gpio);
+    if (result >= 0) {
+        btn->irq = result;
+        result = request_threaded_irq(btn->irq, button_hardirq, button_thread,
+                                      IRQF_TRIGGER_RISING | IRQF_ONESHOT, name, btn);
+    }
+    if (result) {
+        printk(KERN_ALERT "mytraffic: Failed to request IRQ for GPIO %d\n", gpio);
+        btn->irq = -1;
+        return result;
+    }
+
+    /* The thread follows the IRQ's affinity */
+    if (irq_cpu >= 0) {
+        irq_set_affinity_hint(btn->irq, cpumask_of(irq_cpu));
+    }
+    if (irq_prio) {
+        tune_irq_thread(btn);
+    }
+    return 0;
+}
+
+/* Release a button's IRQ and settle timer; the pin goes with the light's */
+static void free_button(struct traffic_button *btn)
+{
+    if (btn->irq < 0) {
+        return;
+    }
+    if (irq_cpu >= 0) {
+        irq_set_affinity_hint(btn->irq, NULL);
+    }
+    free_irq(btn->irq, btn);
+    hrtimer_cancel(&btn->settle);
+    btn->irq = -1;
+}
+
+/* Switch to a new mode; caller holds the state lock */
+static void set_mode_locked(struct traffic_light *light, enum mode mode)
+{
+    if (light->lamp_fault) {
+        mode = FLASHING_RED; // Latched until "clear-fault"
+    }
+    account_mode(light);
+    fsm_set_mode(&light->fsm, mode);
+    notify_state_change(light);
+
+    /* New mode takes effect on the next cycle, not at the end of the current phase */
+    reschedule_next_tick(light, 1);
+    trace_mytraffic_mode(light->index, mode);
+    record_event(light, MYTRAFFIC_EV_MODE, mode);
+}
+
+/* Change the cycle rate, effective at once, keeping the fraction of the
+    stride being slept through (see grid_set_rate()); caller holds the state
+    lock */
+static void set_rate_locked(struct traffic_light *light, unsigned int rate_mhz)
+{
+    unsigned int old_mhz = light->rate_mhz;
+    ktime_t now = ktime_get();
+
+    light->rate_mhz = rate_mhz;
+    light->stats.rate_changes++;
+    if (light->pwm_lamps) {
+        if (blink_timing(light)) {
+            schedule_work(&light->pwm_work); // Same blink, new period
+        } else {
+            reschedule_next_tick(light, 1);
+        }
+    } else if (light->next_event != KTIME_MAX && ktime_after(light->next_event, now)) {
+        light->next_event = grid_set_rate(&light->grid, old_mhz, rate_mhz, light->next_event, now);
+        light_armed(light);
+    }
+    notify_state_change(light);
+    trace_mytraffic_rate(light->index, rate_mhz);
+    record_event(light, MYTRAFFIC_EV_RATE, rate_mhz);
+}
+
+/* Register a pedestrian request; caller holds the state lock.
+    Only a mode whose plan serves crossings (NORMAL by default) accepts one. */
+static int request_ped_locked(struct traffic_light *light)
+{
+    const struct traffic_config *cfg;
+    unsigned int wake, left;
+    int result;
+
+    rcu_read_lock();
+    cfg = rcu_dereference(config);
+    result = fsm_request_ped(&light->fsm, early_green(cfg), &wake);
+    if (result < 0) {
+        rcu_read_unlock();
+        return result;
+    }
+    if (result) {
+        light->ped_requested_at = ktime_get();
+        light->arrivals.at[light->arrivals.count++ % PED_ARRIVALS] = light->ped_requested_at;
+        notify_state_change(light);
+
+        /* More demand may shorten the green being slept through */
+        adapt_timing(light, cfg);
+        left = fsm_remaining(&light->fsm, early_green(cfg));
+        if (left < light->grid.stride && (!wake || left < wake)) {
+            wake = left;
+        }
+    }
+    rcu_read_unlock();
+    light->stats.ped_requests++;
+    trace_mytraffic_ped(light->index, 0);
+    record_event(light, MYTRAFFIC_EV_PED_REQUEST, 0);
+
+    /* Served sooner than the phase we sleep through: re-arm from here */
+    if (wake) {
+        reschedule_next_tick(light, wake);
+    }
+    return 0;
+}
+
+/* Length of one repetition of a program in ns, 0 if it runs once */
+static u64 program_period_ns(const struct mytraffic_program *prog)
+{
+    if (prog->flags & MYTRAFFIC_PROG_DAILY) {
+        return 86400ull * NSEC_PER_SEC;
+    }
+    return (u64)prog->period_s * NSEC_PER_SEC;
+}
+
+/* Apply the program step in effect now and point program_timer at the next
+    one; caller holds the state lock. Working from the clock rather than a
+    step index means a clock set past several steps lands on the right one.
+    Returns false once a program that runs once has no steps left. */
+static bool program_step(struct traffic_light *light)
+{
+    const struct mytraffic_program *prog = &light->program;
+    const struct mytraffic_step *step = NULL;
+    u64 period = program_period_ns(prog);
+    u64 elapsed, pos, rep;
+    u64 next = 0;
+    unsigned int i;
+
+    /* Time into the program, split into the round it is on and the position in it */
+    elapsed = max_t(s64, ktime_to_ns(ktime_sub(hrtimer_cb_get_time(&light->program_timer),
+                                               light->program_base)), 0);
+    pos = elapsed;
+    if (period) {
+        div64_u64_rem(elapsed, period, &pos);
+    }
+    rep = elapsed - pos;
+
+    for (i = 0; i < prog->count; i++) {
+        if ((u64)prog->steps[i].at_s * NSEC_PER_SEC > pos) {
+            next = rep + (u64)prog->steps[i].at_s * NSEC_PER_SEC;
+            break;
+        }
+        step = &prog->steps[i];
+    }
+    if (!step && rep) {
+        step = &prog->steps[prog->count - 1]; // Still on the last step of the previous round
+    }
+    if (i == prog->count && period) {
+        next = rep + period + (u64)prog->steps[0].at_s * NSEC_PER_SEC;
+    }
+
+    if (step) {
+        if ((step->valid & MYTRAFFIC_CFG_RATE) && step->rate * 1000 != light->rate_mhz) {
+            set_rate_locked(light, step->rate * 1000);
+        }
+        if ((step->valid & MYTRAFFIC_CFG_MODE) && step->mode != light->fsm.current_mode) {
+            set_mode_locked(light, step->mode);
+        }
+    }
+    if (i == prog->count && !period) {
+        return false;
+    }
+    hrtimer_set_expires(&light->program_timer, ktime_add_ns(light->program_base, next));
+    return true;
+}
+
+/* Schedule program timer: runs the light's program from the kernel, so its
+    timing owes nothing to user space being scheduled */
+static enum hrtimer_restart program_timer_fn(struct hrtimer *t)
+{
+    struct traffic_light *light = container_of(t, struct traffic_light, program_timer);
+    unsigned long flags;
+    bool more;
+
+    write_seqlock_irqsave(&light->lock, flags);
+    more = program_step(light);
+    write_sequnlock_irqrestore(&light->lock, flags);
+    return more ? HRTIMER_RESTART : HRTIMER_NORESTART;
+}
+
+/* Replace the light's schedule program, applying the step in effect right
+    away. Every step is validated before the old program is stopped. A daily
+    program runs on CLOCK_REALTIME, so it follows the clock being set, in the
+    time zone set when it was loaded; others run on CLOCK_MONOTONIC from now. */
+static int load_program(struct traffic_light *light, const struct mytraffic_program *prog)
+{
+    bool daily = prog->flags & MYTRAFFIC_PROG_DAILY;
+    unsigned long flags;
+    unsigned int i;
+    bool more;
+
+    if ((prog->flags & ~MYTRAFFIC_PROG_DAILY) || prog->count > MYTRAFFIC_MAX_STEPS) {
+        return -EINVAL;
+    }
+    for (i = 0; i < prog->count; i++) {
+        const struct mytraffic_step *step = &prog->steps[i];
+
+        if (!step->valid || (step->valid & ~(MYTRAFFIC_CFG_MODE | MYTRAFFIC_CFG_RATE))) {
+            return -EINVAL;
+        }
+        if (i && step->at_s <= prog->steps[i - 1].at_s) {
+            return -EINVAL; // Steps must be in order
+        }
+        if ((daily && step->at_s >= 86400) ||
+            (!daily && prog->period_s && step->at_s >= prog->period_s)) {
+            return -EINVAL;
+        }
+        if ((step->valid & MYTRAFFIC_CFG_MODE) && step->mode >= NUM_MODES) {
+            return -EINVAL;
+        }
+        if ((step->valid & MYTRAFFIC_CFG_RATE) &&
+            (step->rate < DIV_ROUND_UP(MIN_RATE_MHZ, 1000) || step->rate > MAX_RATE_MHZ / 1000)) {
+            return -ERANGE;
+        }
+        if ((step->valid & MYTRAFFIC_CFG_RATE) && light->corridor) {
+            return -EBUSY;
+        }
+    }
+
+    mutex_lock(&light->program_lock);
+    hrtimer_cancel(&light->program_timer);
+    hrtimer_init(&light->program_timer, daily ? CLOCK_REALTIME : CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+    light->program_timer.function = program_timer_fn;
+
+    write_seqlock_irqsave(&light->lock, flags);
+    light->program = *prog;
+    if (daily) {
+        /* Local midnight on the realtime clock, minus whole days */
+        light->program_base = ns_to_ktime((s64)sys_tz.tz_minuteswest * 60 * NSEC_PER_SEC);
+    } else {
+        light->program_base = hrtimer_cb_get_time(&light->program_timer);
+    }
+    more = prog->count && program_step(light);
+    write_sequnlock_irqrestore(&light->lock, flags);
+
+    if (more) {
+        hrtimer_start_expires(&light->program_timer, HRTIMER_MODE_ABS);
+    }
+    mutex_unlock(&light->program_lock);
+    return 0;
+}
+
+/* State carried across a reload through /proc/mytraffic/state: one line per
+    light of where it is in its plans, when it next changes and its counters.
+    next_ns is CLOCK_MONOTONIC, so a snapshot holds until the next boot. */
+struct traffic_snapshot {
+    u32 light;
+    u32 mode;
+    u32 plan;
+    u32 phase;
+    u32 elapsed;
+    u32 restart;
+    u32 ped_requested;
+    u32 ped_kept;
+    u32 ped_crossing;
+    u32 cycle;
+    u32 green_pct;
+    u32 cross_pct;
+    u32 rate_mhz;
+    u32 stride;
+    u64 next_ns; // 0 while a blink runs on PWM
+    u64 cycles;
+    u64 ped_requests;
+    u64 crossings;
+    u64 rate_changes;
+};
+
+#define SNAPSHOT_KEY(name) { #name, offsetof(struct traffic_snapshot, name), \
+                             sizeof(((struct traffic_snapshot *)0)->name) }
+static const struct {
+    const char *name;
+    size_t offset;
+    size_t size;
+} snapshot_keys[] = {
+    SNAPSHOT_KEY(light), SNAPSHOT_KEY(mode), SNAPSHOT_KEY(plan), SNAPSHOT_KEY(phase),
+    SNAPSHOT_KEY(elapsed), SNAPSHOT_KEY(restart), SNAPSHOT_KEY(ped_requested),
+    SNAPSHOT_KEY(ped_kept), SNAPSHOT_KEY(ped_crossing), SNAPSHOT_KEY(cycle), SNAPSHOT_KEY(green_pct),
+    SNAPSHOT_KEY(cross_pct), SNAPSHOT_KEY(rate_mhz), SNAPSHOT_KEY(stride),
+    SNAPSHOT_KEY(next_ns), SNAPSHOT_KEY(cycles), SNAPSHOT_KEY(ped_requests),
+    SNAPSHOT_KEY(crossings), SNAPSHOT_KEY(rate_changes),
+};
+
+/* Steps a restored light may replay to catch up with the time since its
+    snapshot. Whole cycles of its plan are skipped, so only a restart or
+    crossing in progress and part of one cycle are stepped through; a light
+    needing more carries on from where that left it. */
+#define RESTORE_MAX_STEPS (4 * MAX_PHASES)
+
+static u64 snapshot_get(const struct traffic_snapshot *snap, unsigned int key)
+{
+    const void *field = (const char *)snap + snapshot_keys[key].offset;
+
+    return snapshot_keys[key].size == sizeof(u64) ? *(const u64 *)field : *(const u32 *)field;
+}
+
+static void take_snapshot(struct traffic_light *light, struct traffic_snapshot *snap)
+{
+    const struct traffic_fsm *fsm = &light->fsm;
+    unsigned int seq;
+
+    do {
+        seq = read_seqbegin(&light->lock);
+        snap->light = light->index;
+        snap->mode = fsm->current_mode;
+        snap->plan = fsm->plan;
+        snap->phase = fsm->phase;
+        snap->elapsed = fsm->phase_elapsed;
+        snap->restart = fsm->restart_plan;
+        snap->ped_requested = fsm->ped_requested;
+        snap->ped_kept = fsm->ped_kept;
+        snap->ped_crossing = fsm->ped_crossing;
+        snap->cycle = fsm->cycle_count;
+        snap->green_pct = fsm->green_pct;
+        snap->cross_pct = fsm->cross_pct;
+        snap->rate_mhz = light->rate_mhz;
+        snap->stride = light->grid.stride;
+        snap->next_ns = light->next_event == KTIME_MAX ? 0 : ktime_to_ns(light->next_event);
+        snap->cycles = light->stats.cycles;
+        snap->ped_requests = light->stats.ped_requests;
+        snap->crossings = light->stats.crossings;
+        snap->rate_changes = light->stats.rate_changes;
+    } while (read_seqretry(&light->lock, seq));
+}
+
+static int state_show(struct seq_file *m, void *v)
+{
+    struct traffic_snapshot snap;
+    unsigned long flags;
+    ktime_t epoch;
+    unsigned int i, j;
+
+    if (corridor) {
+        spin_lock_irqsave(&timebase_lock, flags);
+        epoch = wheel.epoch;
+        spin_unlock_irqrestore(&timebase_lock, flags);
+        seq_printf(m, "master_epoch_ns=%lld\n", ktime_to_ns(epoch));
+    }
+    for (i = 0; i < nr_lights; i++) {
+        take_snapshot(lights[i], &snap);
+        for (j = 0; j < ARRAY_SIZE(snapshot_keys); j++) {
+            seq_printf(m, j ? " %s=%llu" : "%s=%llu", snapshot_keys[j].name,
+                       snapshot_get(&snap, j));
+        }
+        seq_putc(m, '\n');
+    }
+    return 0;
+}
+
+static int state_open(struct inode *inode, struct file *filp)
+{
+    return single_open(filp, state_show, NULL);
+}
+
+/* Parse one light's line; every key must be there */
+static int parse_snapshot(char *line, struct traffic_snapshot *snap)
+{
+    unsigned long seen = 0;
+    char *tok, *val;
+    unsigned long long v;
+    unsigned int i;
+
+    while ((tok = strsep(&line, " \t")) != NULL) {
+        if (!*tok) {
+            continue;
+        }
+        val = strchr(tok, '=');
+        if (!val) {
+            return -EINVAL;
+        }
+        *val++ = '\0';
+        for (i = 0; i < ARRAY_SIZE(snapshot_keys); i++) {
+            if (strcmp(tok, snapshot_keys[i].name) == 0) {
+                break;
+            }
+        }
+        if (i == ARRAY_SIZE(snapshot_keys) || kstrtoull(val, 10, &v) ||
+            (snapshot_keys[i].size == sizeof(u32) && v > U32_MAX)) {
+            return -EINVAL;
+        }
+        if (snapshot_keys[i].size == sizeof(u64)) {
+            *(u64 *)((char *)snap + snapshot_keys[i].offset) = v;
+        } else {
+            *(u32 *)((char *)snap + snapshot_keys[i].offset) = v;
+        }
+        seen |= BIT(i);
+    }
+    return seen == BIT(ARRAY_SIZE(snapshot_keys)) - 1 ? 0 : -EINVAL;
+}
+
+/* Put light where the snapshot had it, then work out the steps it would
+    have taken since, so it changes on the same grid tick it would have
+    without the reload; caller holds the lock. Ticks are counted from the
+    wakeup that began the saved stride: on the master grid for a corridor
+    light, on a grid of its own otherwise. */
+static int restore_light(struct traffic_light *light, const struct traffic_snapshot *snap,
+                         unsigned int early)
+{
+    struct traffic_fsm *fsm = &light->fsm;
+    ktime_t now = ktime_get();
+    ktime_t deadline, epoch;
+    unsigned int stride = max_t(u32, snap->stride, 1);
+    u64 base = 0, gone = 0, wake = 0, tick, skip;
+    unsigned int n;
+
+    /* A blink on PWM has no deadline; the timer takes it up on the next tick */
+    if (snap->next_ns) {
+        deadline = ns_to_ktime(snap->next_ns);
+    } else {
+        stride = 1;
+        deadline = ktime_add_ns(now, grid_ticks_ns(stride, snap->rate_mhz));
+    }
+
+    if (snap->mode >= NUM_MODES || snap->plan >= NUM_PLANS ||
+        (snap->plan != PLAN_CROSSING && snap->plan != snap->mode && !snap->restart) ||
+        snap->phase >= fsm->plans[snap->plan].len ||
+        (snap->ped_crossing != 0) != (snap->plan == PLAN_CROSSING) ||
+        snap->green_pct > MAX_ADAPT_PCT || snap->cross_pct > MAX_ADAPT_PCT ||
+        snap->rate_mhz < MIN_RATE_MHZ || snap->rate_mhz > MAX_RATE_MHZ ||
+        snap->stride > 0xffff || snap->elapsed > 0xffff ||
+        (light->corridor && snap->rate_mhz != light->rate_mhz) ||
+        (light->corridor && ktime_before(deadline, master_deadline(stride))) ||
+        (light->lamp_fault && snap->mode != FLASHING_RED)) {
+        return -EINVAL; // Saved with other plans, settings, master grid or out of a fault
+    }
+
+    account_mode(light);
+    fsm->current_mode = snap->mode;
+    fsm->plan = snap->plan;
+    fsm->phase = snap->phase;
+    fsm->phase_elapsed = snap->elapsed;
+    fsm->restart_plan = snap->restart;
+    fsm->ped_requested = snap->ped_requested;
+    fsm->ped_kept = snap->restart && snap->ped_kept;
+    fsm->ped_crossing = snap->ped_crossing;
+    fsm->cycle_count = snap->cycle;
+    fsm->green_pct = snap->green_pct;
+    fsm->cross_pct = snap->cross_pct;
+    light->rate_mhz = snap->rate_mhz;
+    light->stats.cycles = snap->cycles; // Replaced, so importing twice doesn't count twice
+    light->stats.ped_requests = snap->ped_requests;
+    light->stats.crossings = snap->crossings;
+    light->stats.rate_changes = snap->rate_changes;
+
+    /* gone is the last tick at or before now */
+    if (light->corridor) {
+        epoch = wheel.epoch;
+        base = master_tick(deadline, true) - stride;
+        tick = master_tick(now, false);
+        gone = tick > base ? tick - base : 0;
+    } else {
+        epoch = ktime_sub_ns(deadline, grid_ticks_ns(stride, light->rate_mhz));
+        if (ktime_after(now, epoch)) {
+            gone = grid_ns_ticks(ktime_to_ns(ktime_sub(now, epoch)), light->rate_mhz);
+        }
+    }
+
+    /* Step through what changes the plan, and leap the cycles that repeat it */
+    tick = stride;
+    for (n = 0; tick <= gone && n < RESTORE_MAX_STEPS; n++) {
+        int resync = light->corridor ? corridor_position(light, base + tick) : -1;
+
+        fsm_step(fsm, tick - wake, resync, early);
+        wake = tick;
+        if (fsm_periodic(fsm)) {
+            skip = div_u64(gone - wake, fsm_cycle_len(fsm)) * fsm_cycle_len(fsm);
+            wake += skip;
+            fsm->cycle_count += skip;
+        }
+        tick = wake + fsm_remaining(fsm, early);
+    }
+    if (tick <= gone) {
+        wake = gone;
+        tick = wake + fsm_remaining(fsm, early);
+    }
+    grid_lay(&light->grid, epoch, base + wake, base + tick, light->rate_mhz);
+    light->next_event = grid_deadline(&light->grid);
+
+    if (light->pwm_lamps) {
+        account_lamps(light);
+        light->pwm_lamps = 0;
+        schedule_work(&light->pwm_work);
+    }
+    write_lamps(light, fsm_phase(fsm)->lamps);
+    notify_state_change(light);
+    trace_mytraffic_state(light->index, fsm->plan, fsm->phase, fsm_phase(fsm)->lamps);
+    record_event(light, MYTRAFFIC_EV_STATE, fsm->plan << 8 | fsm->phase);
+    light_armed(light);
+    return 0;
+}
+
+/* Import what state_show() exported, in one write. Lights that can't take
+    their line, e.g. because their plans changed, are left running and the
+    write fails with EINVAL once the others are restored. */
+static ssize_t state_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos)
+{
+    struct traffic_snapshot snap;
+    unsigned long flags;
+    unsigned int early;
+    char *kbuf, *cmd, *line;
+    long long epoch_ns;
+    int result = 0;
+
+    if (count >= PAGE_SIZE) {
+        return -EINVAL;
+    }
+    kbuf = memdup_user_nul(buf, count);
+    if (IS_ERR(kbuf)) {
+        return PTR_ERR(kbuf);
+    }
+    rcu_read_lock();
+    early = early_green(rcu_dereference(config));
+    rcu_read_unlock();
+
+    cmd = kbuf;
+    while ((line = strsep(&cmd, "\n")) != NULL) {
+        if (!*line) {
+            continue;
+        }
+        /* The master grid goes first so corridor lights replay against it */
+        if (strncmp(line, "master_epoch_ns=", 16) == 0) {
+            unsigned int i;
+
+            if (!corridor || kstrtoll(line + 16, 10, &epoch_ns)) {
+                result = -EINVAL;
+                continue;
+            }
+            spin_lock_irqsave(&timebase_lock, flags);
+            wheel.epoch = ns_to_ktime(epoch_ns);
+            wheel.served = master_tick(ktime_get(), false);
+            spin_unlock_irqrestore(&timebase_lock, flags);
+
+            /* Corridor lights are laid out again on the new grid, woken on
+                its last tick, so ones without a line of their own (or whose
+                line is refused) step on its next tick */
+            for (i = 0; i < nr_lights; i++) {
+                struct traffic_light *light = lights[i];
+                u64 tick;
+
+                if (!light->corridor) {
+                    continue;
+                }
+                write_seqlock_irqsave(&light->lock, flags);
+                tick = master_tick(ktime_get(), false);
+                grid_lay(&light->grid, wheel.epoch, tick, tick, light->rate_mhz);
+                reschedule_next_tick(light, 1);
+                write_sequnlock_irqrestore(&light->lock, flags);
+            }
+            continue;
+        }
+        if (parse_snapshot(line, &snap) || snap.light >= nr_lights) {
+            result = -EINVAL;
+            continue;
+        }
+        write_seqlock_irqsave(&lights[snap.light]->lock, flags);
+        if (restore_light(lights[snap.light], &snap, early)) {
+            result = -EINVAL;
+        }
+        write_sequnlock_irqrestore(&lights[snap.light]->lock, flags);
+    }
+    kfree(kbuf);
+    return result ? result : count;
+}
+
+/* Toggle Button press: Normal -> Flashing Red -> Flashing Yellow -> Normal */
+static void toggle_pressed(struct traffic_light *light)
+{
+    unsigned long flags;
+
+    write_seqlock_irqsave(&light->lock, flags);
+    set_mode_locked(light, (light->fsm.current_mode + 1) % NUM_MODES);
+    write_sequnlock_irqrestore(&light->lock, flags);
+}
+
+/* Pedestrian button press: set the ped_requested flag where the mode serves it */
+static void ped_pressed(struct traffic_light *light)
+{
+    unsigned long flags;
+
+    write_seqlock_irqsave(&light->lock, flags);
+    request_ped_locked(light);
+    write_sequnlock_irqrestore(&light->lock, flags);
+}
+
+/* Binary control interface, see mytraffic.h.
+    Every command is validated in full before anything is applied, and a
+    configuration is applied under one lock hold, so it takes effect
+    atomically or not at all. */
+static long mytraffic_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    struct traffic_file *tf = filp->private_data;
+    struct traffic_light *light = tf->light;
+    void __user *argp = (void __user *)arg;
+    struct mytraffic_config cfg;
+    struct mytraffic_state state;
+    struct mytraffic_slack slack;
+    struct mytraffic_program prog;
+    struct traffic_status st;
+    unsigned long flags;
+    __u32 value;
+    int result = 0;
+
+    switch (cmd) {
+        case MYTRAFFIC_IOC_SET_MODE:
+            if (get_user(value, (__u32 __user *)argp)) {
+                return -EFAULT;
+            }
+            cfg.valid = MYTRAFFIC_CFG_MODE;
+            cfg.mode = value;
+            break;
+        case MYTRAFFIC_IOC_SET_RATE:
+            if (get_user(value, (__u32 __user *)argp)) {
+                return -EFAULT;
+            }
+            cfg.valid = MYTRAFFIC_CFG_RATE;
+            cfg.rate = value;
+            break;
+        case MYTRAFFIC_IOC_SET_RATE_MHZ:
+            if (get_user(value, (__u32 __user *)argp)) {
+                return -EFAULT;
+            }
+            cfg.valid = MYTRAFFIC_CFG_RATE_MHZ;
+            cfg.rate_mhz = value;
+            break;
+        case MYTRAFFIC_IOC_TRIGGER_PED:
+            cfg.valid = MYTRAFFIC_CFG_PED;
+            break;
+        case MYTRAFFIC_IOC_SET_CONFIG:
+            if (copy_from_user(&cfg, argp, sizeof(cfg))) {
+                return -EFAULT;
+            }
+            break;
+        case MYTRAFFIC_IOC_GET_STATE:
+            read_status(light, &st);
+            fill_state(&st, &state);
+            if (copy_to_user(argp, &state, sizeof(state))) {
+                return -EFAULT;
+            }
+            return 0;
+        case MYTRAFFIC_IOC_SET_FORMAT:
+            if (get_user(value, (__u32 __user *)argp)) {
+                return -EFAULT;
+            }
+            if (value > MYTRAFFIC_FMT_JSON) {
+                return -EINVAL;
+            }
+            mutex_lock(&tf->lock);
+            tf->format = value;
+            tf->text_valid = false; // Next read renders the new format
+            mutex_unlock(&tf->lock);
+            return 0;
+        case MYTRAFFIC_IOC_SET_SLACK:
+            if (copy_from_user(&slack, argp, sizeof(slack))) {
+                return -EFAULT;
+            }
+            if (slack.mode >= NUM_MODES) {
+                return -EINVAL;
+            }
+            if (slack.slack_us > MAX_SLACK_US) {
+                return -ERANGE;
+            }
+            /* Takes effect from the next time the light arms */
+            WRITE_ONCE(light->slack_us[slack.mode], slack.slack_us);
+            return 0;
+        case MYTRAFFIC_IOC_GET_SLACK:
+            if (copy_from_user(&slack, argp, sizeof(slack))) {
+                return -EFAULT;
+            }
+            if (slack.mode >= NUM_MODES) {
+                return -EINVAL;
+            }
+            slack.slack_us = READ_ONCE(light->slack_us[slack.mode]);
+            if (copy_to_user(argp, &slack, sizeof(slack))) {
+                return -EFAULT;
+            }
+            return 0;
+        case MYTRAFFIC_IOC_SET_PROGRAM:
+            if (copy_from_user(&prog, argp, sizeof(prog))) {
+                return -EFAULT;
+            }
+            return load_program(light, &prog);
+        default:
+            return -ENOTTY;
+    }
+
+    if (cfg.valid & ~MYTRAFFIC_CFG_ALL) {
+        return -EINVAL;
+    }
+    if ((cfg.valid & MYTRAFFIC_CFG_MODE) && cfg.mode >= NUM_MODES) {
+        return -EINVAL;
+    }
+    if ((cfg.valid & MYTRAFFIC_CFG_RATE) && (cfg.valid & MYTRAFFIC_CFG_RATE_MHZ)) {
+        return -EINVAL;
+    }
+    if (cfg.valid & MYTRAFFIC_CFG_RATE) {
+        /* Whole Hz: carried on as mHz, anything too large as 0 to fail below */
+        cfg.valid ^= MYTRAFFIC_CFG_RATE | MYTRAFFIC_CFG_RATE_MHZ;
+        cfg.rate_mhz = cfg.rate <= MAX_RATE_MHZ / 1000 ? cfg.rate * 1000 : 0;
+    }
+    if ((cfg.valid & MYTRAFFIC_CFG_RATE_MHZ) &&
+        (cfg.rate_mhz < MIN_RATE_MHZ || cfg.rate_mhz > MAX_RATE_MHZ)) {
+        return -ERANGE;
+    }
+    if ((cfg.valid & MYTRAFFIC_CFG_RATE_MHZ) && light->corridor) {
+        return -EBUSY;
+    }
+
+    write_seqlock_irqsave(&light->lock, flags);
+    /* A light held in flashing red by a lamp fault takes no other mode, and
+        a request can only be accepted by the mode being switched to, which
+        then serves it once it starts */
+    if ((cfg.valid & MYTRAFFIC_CFG_MODE) && light->lamp_fault && cfg.mode != FLASHING_RED) {
+        result = -EIO;
+    } else if ((cfg.valid & MYTRAFFIC_CFG_PED) &&
+        !fsm_serves_ped(&light->fsm.plans[(cfg.valid & MYTRAFFIC_CFG_MODE) ?
+                                         cfg.mode : light->fsm.current_mode])) {
+        result = -EINVAL;
+    } else {
+        if (cfg.valid & MYTRAFFIC_CFG_RATE_MHZ) {
+            set_rate_locked(light, cfg.rate_mhz);
+        }
+        if (cfg.valid & MYTRAFFIC_CFG_MODE) {
+            set_mode_locked(light, cfg.mode);
+        }
+        if (cfg.valid & MYTRAFFIC_CFG_PED) {
+            request_ped_locked(light);
+        }
+    }
+    write_sequnlock_irqrestore(&light->lock, flags);
+    return result;
+}
+
+/* All of a light's pins, for one gpio_request_array() and one
+    gpio_free_array(): the lamps, driven as the light shows them, then the
+    readback inputs and buttons it has. Returns how many. */
+#define MAX_LIGHT_PINS (2 * NUM_LAMPS + 2)
+static unsigned int light_pins(const struct traffic_light *light, struct gpio *pins)
+{
+    static const char * const lamp_names[NUM_LAMPS] = { "Red", "Yellow", "Green" };
+    static const char * const sense_names[NUM_LAMPS] = { "Red sense", "Yellow sense", "Green sense" };
+    unsigned int i, n = 0;
+
+    for (i = 0; i < NUM_LAMPS; i++) {
+        pins[n].gpio = light->lamp_gpio[i];
+        pins[n].flags = (light->lamps & BIT(i)) ? GPIOF_OUT_INIT_HIGH : GPIOF_OUT_INIT_LOW;
+        pins[n++].label = lamp_names[i];
+    }
+    for (i = 0; i < NUM_LAMPS && light->sense_gpio[0] >= 0; i++) {
+        pins[n].gpio = light->sense_gpio[i];
+        pins[n].flags = GPIOF_IN;
+        pins[n++].label = sense_names[i];
+    }
+    if (light->toggle_btn.gpio >= 0) {
+        pins[n].gpio = light->toggle_btn.gpio;
+        pins[n].flags = GPIOF_IN;
+        pins[n++].label = "Toggle button";
+    }
+    if (light->ped_btn.gpio >= 0) {
+        pins[n].gpio = light->ped_btn.gpio;
+        pins[n].flags = GPIOF_IN;
+        pins[n++].label = "Pedestrian button";
+    }
+    return n;
+}
+
+static void free_pins(const struct traffic_light *light)
+{
+    struct gpio pins[MAX_LIGHT_PINS];
+
+    gpio_free_array(pins, light_pins(light, pins));
+}
+
+/* Take up the pins of light index in one batch, lamps first in their
+    starting state. Readback inputs are read with the lamp write under the
+    state lock, so they must be on a controller that doesn't sleep. */
+static int request_pins(struct traffic_light *light, unsigned int index)
+{
+    struct gpio pins[MAX_LIGHT_PINS];
+    unsigned int i, sensed = 0;
+    int result;
+
+    light->lamp_gpio[0] = red_gpio[index];
+    light->lamp_gpio[1] = yellow_gpio[index];
+    light->lamp_gpio[2] = green_gpio[index];
+    light->sense_gpio[0] = sense_red_gpio[index];
+    light->sense_gpio[1] = sense_yellow_gpio[index];
+    light->sense_gpio[2] = sense_green_gpio[index];
+    light->toggle_btn.gpio = toggle_gpio[index];
+    light->ped_btn.gpio = ped_gpio[index];
+    for (i = 0; i < NUM_LAMPS; i++) {
+        sensed += light->sense_gpio[i] >= 0;
+    }
+    if (sensed && sensed != NUM_LAMPS) {
+        printk(KERN_ALERT "mytraffic: Light %u needs a sense GPIO for every lamp\n", index);
+        return -EINVAL;
+    }
+
+    result = gpio_request_array(pins, light_pins(light, pins));
+    if (result) {
+        printk(KERN_ALERT "mytraffic: Failed to request the GPIOs of light %u\n", index);
+        return result;
+    }
+    for (i = 0; i < NUM_LAMPS; i++) {
+        light->lamp_desc[i] = gpio_to_desc(light->lamp_gpio[i]);
+    }
+    light->lamps_one_bank =
+        gpiod_to_chip(light->lamp_desc[0]) == gpiod_to_chip(light->lamp_desc[1]) &&
+        gpiod_to_chip(light->lamp_desc[1]) == gpiod_to_chip(light->lamp_desc[2]);
+
+    if (!sensed) {
+        return 0; // Unchecked
+    }
+    for (i = 0; i < NUM_LAMPS; i++) {
+        light->sense_desc[i] = gpio_to_desc(light->sense_gpio[i]);
+        if (gpiod_cansleep(light->sense_desc[i])) {
+            printk(KERN_ALERT "mytraffic: Sense GPIO %d is on a sleeping controller\n",
+                   light->sense_gpio[i]);
+            free_pins(light);
+            return -EINVAL;
+        }
+    }
+    light->verify = true;
+    printk(KERN_INFO "mytraffic: Light %u lamps read back on GPIOs %d/%d/%d\n", index,
+           light->sense_gpio[0], light->sense_gpio[1], light->sense_gpio[2]);
+    return 0;
+}
+
+/* Set up signal head index: lamp pins, buttons and initial state.
+    The instance is not on the timer base until mytraffic_init starts it. */
+static struct traffic_light *light_create(unsigned int index)
+{
+    struct traffic_light *light;
+    unsigned int i;
+    int result;
+
+    /* Allocate traffic light structure */
+    light = kzalloc(sizeof(struct traffic_light), GFP_KERNEL);
+    if (!light) {
+        return ERR_PTR(-ENOMEM);
+    }
+    light->shared = (struct mytraffic_shared *)get_zeroed_page(GFP_KERNEL);
+    if (!light->shared) {
+        result = -ENOMEM;
+        goto fail_page;
+    }
+
+    /* Initialize traffic light state */
+    light->index = index;
+    seqlock_init(&light->lock);
+    init_waitqueue_head(&light->wq);
+    light->generation = 0;
+    light->rate_mhz = 1000; // default to 1Hz, add add'l functionality later, time permitting
+    for (i = 0; i < NUM_MODES; i++) {
+        light->slack_us[i] = min_t(unsigned int, slack_us[i], MAX_SLACK_US);
+    }
+    light->corridor = corridor;
+    light->offset = offset_ticks[index];
+    if (light->corridor) {
+        light->rate_mhz = corridor_rate * 1000;
+    }
+    fsm_init(&light->fsm);
+    light->lamps = LAMP_GREEN; // Start with state 0...green light
+    light->stats.mode_since = ktime_get();
+    light->stats.lamps_since = light->stats.mode_since;
+
+    /* Grid is laid out before the IRQs so a button can re-arm it */
+    grid_start(&light->grid, ktime_get(), light->rate_mhz);
+    light->grid.stride = light->fsm.plans[NORMAL].phases[0].ticks;
+    light->next_event = KTIME_MAX;
+
+    /* No program until one is loaded */
+    mutex_init(&light->program_lock);
+    hrtimer_init(&light->program_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+    light->program_timer.function = program_timer_fn;
+
+    /* Setup GPIO pins */
+    result = request_pins(light, index);
+    if (result) {
+        goto fail_pins;
+    }
+
+    INIT_WORK(&light->pwm_work, pwm_work_fn);
+    result = request_pwms(light);
+    if (result) {
+        goto fail_pwm;
+    }
+
+    result = setup_button(light, &light->toggle_btn, toggle_gpio[index],
+                          "toggle_button_handler", toggle_pressed);
+    if (result) {
+        goto fail_toggle;
+    }
+    result = setup_button(light, &light->ped_btn, ped_gpio[index],
+                          "ped_button_handler", ped_pressed);
+    if (result) {
+        goto fail_ped;
+    }
+
+    update_shared_page(light);
+    printk(KERN_INFO "mytraffic: Light %u on GPIOs %d/%d/%d ready\n", index,
+           light->lamp_gpio[0], light->lamp_gpio[1], light->lamp_gpio[2]);
+    return light;
+
+fail_ped:
+    free_button(&light->toggle_btn);
+fail_toggle:
+    free_pwms(light);
+fail_pwm:
+    free_pins(light);
+fail_pins:
+    free_page((unsigned long)light->shared);
+fail_page:
+    kfree(light);
+    return ERR_PTR(result);
+}
+
+/* True if gpio is one of light's lamp pins */
+static bool owns_lamp_pin(const struct traffic_light *light, int gpio)
+{
+    unsigned int i;
+
+    for (i = 0; i < NUM_LAMPS; i++) {
+        if (light->lamp_gpio[i] == gpio) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Move the light's lamps to other GPIOs while it runs. The new pins are
+    requested first and take over, showing the lamps lit, in one step under
+    the state lock, so the light is never dark; the old ones are switched
+    off and released after. Pins can also trade places within the light. */
+static int set_lamp_pins(struct traffic_light *light, const int gpio[NUM_LAMPS])
+{
+    static const char * const names[NUM_LAMPS] = { "Red", "Yellow", "Green" };
+    struct gpio_desc *desc[NUM_LAMPS];
+    int old[NUM_LAMPS];
+    unsigned long flags;
+    unsigned int i, j;
+    int result = 0;
+
+    if (light->verify) {
+        return -EBUSY; // The readback inputs are wired to the pins in use
+    }
+    for (i = 0; i < NUM_LAMPS; i++) {
+        if (!gpio_is_valid(gpio[i])) {
+            return -EINVAL;
+        }
+        for (j = 0; j < i; j++) {
+            if (gpio[i] == gpio[j]) {
+                return -EINVAL;
+            }
+        }
+    }
+
+    mutex_lock(&config_lock);
+    for (i = 0; i < NUM_LAMPS; i++) {
+        if (owns_lamp_pin(light, gpio[i])) {
+            continue;
+        }
+        result = gpio_request(gpio[i], names[i]);
+        if (result) {
+            printk(KERN_ALERT "mytraffic: Failed to request GPIO %d\n", gpio[i]);
+            while (i--) {
+                if (!owns_lamp_pin(light, gpio[i])) {
+                    gpio_free(gpio[i]);
+                }
+            }
+            mutex_unlock(&config_lock);
+            return result;
+        }
+        gpio_direction_output(gpio[i], 0);
+    }
+    for (i = 0; i < NUM_LAMPS; i++) {
+        desc[i] = gpio_to_desc(gpio[i]);
+    }
+
+    write_seqlock_irqsave(&light->lock, flags);
+    memcpy(old, light->lamp_gpio, sizeof(old));
+    memcpy(light->lamp_gpio, gpio, sizeof(light->lamp_gpio));
+    memcpy(light->lamp_desc, desc, sizeof(light->lamp_desc));
+    light->lamps_one_bank = gpiod_to_chip(desc[0]) == gpiod_to_chip(desc[1]) &&
+                            gpiod_to_chip(desc[1]) == gpiod_to_chip(desc[2]);
+    set_lamp_outputs(light, light->lamps);
+    write_sequnlock_irqrestore(&light->lock, flags);
+
+    for (i = 0; i < NUM_LAMPS; i++) {
+        if (!owns_lamp_pin(light, old[i])) {
+            gpio_set_value(old[i], 0);
+            gpio_free(old[i]);
+        }
+    }
+    mutex_unlock(&config_lock);
+    printk(KERN_INFO "mytraffic: Light %u moved to GPIOs %d/%d/%d\n", light->index,
+           gpio[0], gpio[1], gpio[2]);
+    return 0;
+}
+
+/* Create light's device, named mytraffic for light 0 and mytraffic<n> after
+    it, so udev makes the node and the sysfs attributes appear with it */
+static int light_add_device(struct traffic_light *light)
+{
+    struct kernfs_node *kn[NUM_ATTRS];
+    struct device *dev;
+    unsigned long flags;
+    char name[16];
+    unsigned int i;
+
+    if (light->index) {
+        snprintf(name, sizeof(name), "mytraffic%u", light->index);
+    } else {
+        snprintf(name, sizeof(name), "mytraffic");
+    }
+    dev = device_create_with_groups(mytraffic_class, NULL, mytraffic_devt + light->index,
+                                    light, mytraffic_groups, "%s", name);
+    if (IS_ERR(dev)) {
+        printk(KERN_ALERT "mytraffic: cannot create device %s\n", name);
+        return PTR_ERR(dev);
+    }
+    for (i = 0; i < NUM_ATTRS; i++) {
+        kn[i] = sysfs_get_dirent(dev->kobj.sd, mytraffic_attrs[i]->name);
+    }
+
+    write_seqlock_irqsave(&light->lock, flags);
+    light->dev = dev;
+    memcpy(light->attr_kn, kn, sizeof(kn));
+    attr_values(light, light->attr_value);
+    write_sequnlock_irqrestore(&light->lock, flags);
+    return 0;
+}
+
+/* Remove light's device; sysfs readers are drained before it returns */
+static void light_remove_device(struct traffic_light *light)
+{
+    struct kernfs_node *kn[NUM_ATTRS];
+    unsigned long flags;
+    unsigned int i;
+
+    if (!light || !light->dev) {
+        return;
+    }
+    write_seqlock_irqsave(&light->lock, flags);
+    memcpy(kn, light->attr_kn, sizeof(kn));
+    memset(light->attr_kn, 0, sizeof(light->attr_kn));
+    write_sequnlock_irqrestore(&light->lock, flags);
+
+    for (i = 0; i < NUM_ATTRS; i++) {
+        if (kn[i]) {
+            sysfs_put(kn[i]);
+        }
+    }
+    device_destroy(mytraffic_class, mytraffic_devt + light->index);
+    light->dev = NULL;
+}
+
+/* Undo the character device registration in mytraffic_init */
+static void unregister_device(void)
+{
+    class_destroy(mytraffic_class);
+    cdev_del(&mytraffic_cdev);
+    unregister_chrdev_region(mytraffic_devt, nr_lights);
+}
+
+/* Tear down an instance; the timer base must already be stopped */
+static void light_destroy(struct traffic_light *light)
+{
+    /* Turn off all LEDs */
+    cancel_work_sync(&light->pwm_work);
+    if (light->pwm_running) {
+        pwm_disable(light->pwm_running);
+    }
+    free_pwms(light);
+    light->verify = false; // A lamp going dark now is not a fault
+    write_lamps(light, 0);
+
+    /* Free the pins */
+    free_pins(light);
+
+    free_page((unsigned long)light->shared);
+    kfree(light);
+}
+
+/* Init Function */
+static int mytraffic_init(void) {
+    struct traffic_light *light;
+    unsigned long flags;
+    ktime_t now;
+    unsigned int i;
+    int result;
+    printk(KERN_INFO
+    "mytraffic: Initializing traffic light module\n");
+
+    if (nr_lights < 1 || nr_yellow != nr_lights || nr_green != nr_lights) {
+        printk(KERN_ALERT
+        "mytraffic: red_gpio, yellow_gpio and green_gpio need one entry per light\n");
+        return -EINVAL;
+    }
+    if (corridor && (corridor_rate < 1 || corridor_rate > MAX_RATE_MHZ / 1000)) {
+        printk(KERN_ALERT
+        "mytraffic: corridor_rate must be 1 to %u Hz\n", MAX_RATE_MHZ / 1000);
+        return -EINVAL;
+    }
+    if (irq_prio < 0 || irq_prio >= MAX_RT_PRIO ||
+        (strcmp(irq_policy, "fifo") != 0 && strcmp(irq_policy, "rr") != 0)) {
+        printk(KERN_ALERT
+        "mytraffic: irq_prio must be 0 to %d and irq_policy fifo or rr\n", MAX_RT_PRIO - 1);
+        return -EINVAL;
+    }
+    if ((irq_cpu >= 0 && (irq_cpu >= nr_cpu_ids || !cpu_online(irq_cpu))) ||
+        (timer_cpu >= 0 && (timer_cpu >= nr_cpu_ids || !cpu_online(timer_cpu)))) {
+        printk(KERN_ALERT "mytraffic: irq_cpu and timer_cpu must be -1 or an online CPU\n");
+        return -EINVAL;
+    }
+
+    /* Register the character device: a dynamic major, minor n for light n,
+        and a class for udev to make the nodes from */
+    result = alloc_chrdev_region(&mytraffic_devt, 0, nr_lights, "mytraffic");
+    if (result < 0) {
+        printk(KERN_ALERT "mytraffic: cannot obtain a major number\n");
+        return result;
+    }
+    cdev_init(&mytraffic_cdev, &mytraffic_fops);
+    mytraffic_cdev.owner = THIS_MODULE;
+    result = cdev_add(&mytraffic_cdev, mytraffic_devt, nr_lights);
+    if (result) {
+        unregister_chrdev_region(mytraffic_devt, nr_lights);
+        return result;
+    }
+    mytraffic_class = class_create(THIS_MODULE, "mytraffic");
+    if (IS_ERR(mytraffic_class)) {
+        cdev_del(&mytraffic_cdev);
+        unregister_chrdev_region(mytraffic_devt, nr_lights);
+        return PTR_ERR(mytraffic_class);
+    }
+
+    /* Published before anything that reads it can run */
+    RCU_INIT_POINTER(config, config_from_params());
+    if (!rcu_access_pointer(config)) {
+        unregister_device();
+        return -ENOMEM;
+    }
+
+    /* Timer base is set up before the IRQs so a button can re-arm it */
+    hrtimer_init(&timebase, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+    timebase.function = timer_callback;
+    init_irq_work(&timebase_work, timebase_work_fn);
+
+    for (i = 0; i < nr_lights; i++) {
+        light = light_create(i);
+        if (IS_ERR(light)) {
+            result = PTR_ERR(light);
+            goto fail;
+        }
+        lights[i] = light;
+    }
+
+    /* Every light's first phase holds from now until its last cycle ends.
+        Corridor lights start offset into their plan, all on master tick 0. */
+    now = ktime_get();
+    wheel.epoch = now;
+    wheel.rate = corridor_rate;
+    wheel.served = 0;
+    for (i = 0; i < nr_lights; i++) {
+        light = lights[i];
+        write_seqlock_irqsave(&light->lock, flags);
+        grid_start(&light->grid, now, light->rate_mhz);
+        if (light->corridor) {
+            fsm_seek(&light->fsm, corridor_position(light, 0));
+            light->grid.stride = fsm_remaining(&light->fsm, 0);
+            write_lamps(light, fsm_phase(&light->fsm)->lamps);
+        }
+        light->grid.ticks = light->grid.stride;
+        light->next_event = grid_deadline(&light->grid);
+        light_armed(light);
+        write_sequnlock_irqrestore(&light->lock, flags);
+    }
+
+    for (i = 0; i < nr_lights; i++) {
+        result = light_add_device(lights[i]);
+        if (result) {
+            goto fail_devices;
+        }
+    }
+
+    /* Counters are a debugging aid; the module runs without them */
+    debug_dir = debugfs_create_dir("mytraffic", NULL);
+    for (i = 0; i < nr_lights; i++) {
+        char name[16];
+
+        snprintf(name, sizeof(name), "light%u", i);
+        debugfs_create_file(name, 0444, debug_dir, lights[i], &counters_fops);
+    }
+
+    /* These read lights[], so they appear only once every light is armed */
+    proc_dir = proc_mkdir("mytraffic", NULL);
+    if (!proc_dir || !proc_create("events", 0444, proc_dir, &events_fops) ||
+        !proc_create("latency", 0644, proc_dir, &latency_fops) ||
+        !proc_create("ped", 0644, proc_dir, &ped_stats_fops) ||
+        !proc_create("config", 0644, proc_dir, &config_fops) ||
+        !proc_create("state", 0600, proc_dir, &state_fops)) {
+        printk(KERN_ALERT "mytraffic: cannot create /proc/mytraffic\n");
+        result = -ENOMEM;
+        goto fail_proc;
+    }
+
+    printk(KERN_INFO "mytraffic: Traffic light module initialized with %u light(s), major %d\n",
+           nr_lights, MAJOR(mytraffic_devt));
+    return 0;
+
+fail_proc:
+    proc_remove(proc_dir);
+    debugfs_remove_recursive(debug_dir);
+fail_devices:
+    for (i = 0; i < nr_lights; i++) {
+        light_remove_device(lights[i]);
+    }
+    i = nr_lights;
+fail:
+    while (i--) {
+        free_button(&lights[i]->toggle_btn);
+        free_button(&lights[i]->ped_btn);
+        hrtimer_cancel(&lights[i]->program_timer);
+    }
+    irq_work_sync(&timebase_work);
+    hrtimer_cancel(&timebase);
+    for (i = 0; i < nr_lights; i++) {
+        if (lights[i]) {
+            light_destroy(lights[i]);
+            lights[i] = NULL;
+        }
+    }
+    kfree(rcu_access_pointer(config));
+    unregister_device();
+    return result;
+}
+
+static void mytraffic_exit(void)
+{
+    unsigned int i;
+
+    printk(KERN_INFO "mytraffic: Cleaning up...\n");
+
+    /* These read the lights; removal waits for readers to finish */
+    for (i = 0; i < nr_lights; i++) {
+        light_remove_device(lights[i]);
+    }
+    debugfs_remove_recursive(debug_dir);
+    proc_remove(proc_dir);
+
+    /* Free the Interrupts and programs first, so nothing can re-arm the timer */
+    for (i = 0; i < nr_lights; i++) {
+        free_button(&lights[i]->toggle_btn);
+        free_button(&lights[i]->ped_btn);
+        hrtimer_cancel(&lights[i]->program_timer);
+    }
+
+    /* Remove timer, once any kick handed to timer_cpu has landed */
+    irq_work_sync(&timebase_work);
+    hrtimer_cancel(&timebase);
+    printk(KERN_INFO "mytraffic: Timer stopped\n");
+
+    for (i = 0; i < nr_lights; i++) {
+        light_destroy(lights[i]);
+        lights[i] = NULL;
+    }
+    kfree(rcu_access_pointer(config)); // Its last readers are gone with the IRQs and timer
+    printk(KERN_INFO "mytraffic: GPIOs and memory freed\n");
+
+    /* Unregister character device */
+    unregister_device();
+    printk(KERN_INFO "mytraffic: Character device unregistered\n");
+    printk(KERN_INFO "mytraffic: Module unloaded\n");
+}
@@ -0,0 +1,155 @@
+/* mytraffic user space interface
+    Shared between the module and programs that mmap or ioctl /dev/mytraffic */
+#ifndef MYTRAFFIC_H
+#define MYTRAFFIC_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/* Operational modes */
+#define MYTRAFFIC_MODE_NORMAL          0
+#define MYTRAFFIC_MODE_FLASHING_RED    1
+#define MYTRAFFIC_MODE_FLASHING_YELLOW 2
+
+/* Lamp bitmask */
+#define MYTRAFFIC_LAMP_RED    0x1
+#define MYTRAFFIC_LAMP_YELLOW 0x2
+#define MYTRAFFIC_LAMP_GREEN  0x4
+
+/* Status page: mmap one page at offset 0 of /dev/mytraffic, read-only.
+    The kernel rewrites it on every state change, including a phase change
+    that leaves the lamps as they were. phase_elapsed and cycle_count are
+    as of timestamp_ns: the page is not touched between state changes, so
+    add the cycles since then at rate_mhz for a current count. seq is odd while an update
+    is in progress, so sample it like a seqcount:
+
+        do {
+            s = page->seq;  (then a read barrier)
+            copy the fields
+            (read barrier)
+        } while ((s & 1) || s != page->seq);
+*/
+struct mytraffic_shared {
+    __u32 seq; // Odd while the kernel is writing the page
+    __u32 generation; // Same counter poll() and read() track
+    __u32 mode; // MYTRAFFIC_MODE_*
+    __u32 rate; // Cycle rate in Hz, rounded down
+    __u32 lamps; // MYTRAFFIC_LAMP_* bits lit
+    __u32 ped_requested; // Pedestrian waiting to cross
+    __u32 ped_crossing; // Pedestrian crossing in progress
+    __u32 plan; // Plan being run: the mode, or 3 for the crossing
+    __u32 phase; // Phase index within the plan
+    __u32 phase_elapsed; // Cycles spent in the phase
+    __u32 cycle_count; // Cycles since the mode or crossing last restarted
+    __u32 rate_mhz; // Cycle rate in mHz
+    __u64 timestamp_ns; // CLOCK_MONOTONIC time of the update
+};
+
+/* Snapshot returned by MYTRAFFIC_IOC_GET_STATE */
+struct mytraffic_state {
+    __u32 generation; // Same counter poll() and read() track
+    __u32 mode; // MYTRAFFIC_MODE_*
+    __u32 rate; // Cycle rate in Hz, rounded down
+    __u32 lamps; // MYTRAFFIC_LAMP_* bits lit
+    __u32 ped_requested;
+    __u32 ped_crossing;
+    __u32 rate_mhz; // Cycle rate in mHz
+};
+
+/* What read() on /dev/mytraffic returns, chosen per open file with
+    MYTRAFFIC_IOC_SET_FORMAT. Every format describes one state per read from
+    offset 0; BINARY is a struct mytraffic_state. */
+#define MYTRAFFIC_FMT_TEXT     0 // Human-readable lines (default)
+#define MYTRAFFIC_FMT_BINARY   1 // struct mytraffic_state
+#define MYTRAFFIC_FMT_KEYVALUE 2 // One line of key=value pairs
+#define MYTRAFFIC_FMT_JSON     3 // One JSON object per line
+
+/* Fields of struct mytraffic_config to apply */
+#define MYTRAFFIC_CFG_MODE 0x1 // Switch to mode
+#define MYTRAFFIC_CFG_RATE 0x2 // Set rate
+#define MYTRAFFIC_CFG_PED  0x4 // Inject a pedestrian request, of the new mode with CFG_MODE
+#define MYTRAFFIC_CFG_RATE_MHZ 0x8 // Set rate_mhz, instead of rate
+#define MYTRAFFIC_CFG_ALL  0xf
+
+/* Argument of MYTRAFFIC_IOC_SET_CONFIG: every field flagged in valid is
+    applied together, or none is */
+struct mytraffic_config {
+    __u32 valid; // MYTRAFFIC_CFG_* bits
+    __u32 mode; // MYTRAFFIC_MODE_*
+    __u32 rate; // Cycle rate in Hz
+    __u32 rate_mhz; // Cycle rate in mHz, for fractional rates
+};
+
+/* Argument of MYTRAFFIC_IOC_SET_SLACK and MYTRAFFIC_IOC_GET_SLACK: how
+    late, up to 100000 us, a state change of the light may be while it is
+    in mode, so the kernel can batch the wakeup. 0 keeps it exact. */
+struct mytraffic_slack {
+    __u32 mode; // MYTRAFFIC_MODE_*
+    __u32 slack_us;
+};
+
+/* Schedule program, run by the module from its own timer. Each step applies
+    the settings flagged in valid once the program reaches at_s seconds, and
+    they hold until the next step. A program runs once from upload, repeats
+    every period_s seconds, or with MYTRAFFIC_PROG_DAILY follows the local
+    time of day, at_s being seconds after midnight. Steps are in increasing
+    order of at_s; uploading a program with count 0 stops the one running. */
+#define MYTRAFFIC_PROG_DAILY 0x1
+#define MYTRAFFIC_MAX_STEPS  16
+
+struct mytraffic_step {
+    __u32 at_s; // Seconds into the program, or after midnight if DAILY
+    __u32 valid; // MYTRAFFIC_CFG_MODE and/or MYTRAFFIC_CFG_RATE
+    __u32 mode; // MYTRAFFIC_MODE_*
+    __u32 rate; // Cycle rate in Hz
+};
+
+/* Argument of MYTRAFFIC_IOC_SET_PROGRAM */
+struct mytraffic_program {
+    __u32 flags; // MYTRAFFIC_PROG_* bits
+    __u32 count; // Steps used
+    __u32 period_s; // Repeat every period_s seconds, 0 to run once; unused if DAILY
+    __u32 reserved;
+    struct mytraffic_step steps[MYTRAFFIC_MAX_STEPS];
+};
+
+/* Event types in /proc/mytraffic/events */
+#define MYTRAFFIC_EV_STATE          1 // Lamps changed; arg = plan << 8 | phase
+#define MYTRAFFIC_EV_BUTTON         2 // Press got past debounce; arg = GPIO
+#define MYTRAFFIC_EV_PED_REQUEST    3 // Pedestrian request registered
+#define MYTRAFFIC_EV_CROSSING_START 4
+#define MYTRAFFIC_EV_CROSSING_END   5
+#define MYTRAFFIC_EV_MODE           6 // arg = MYTRAFFIC_MODE_*
+#define MYTRAFFIC_EV_RATE           7 // arg = rate in mHz
+#define MYTRAFFIC_EV_PLAN           8 // Phase table loaded; arg = plan index
+#define MYTRAFFIC_EV_LAMP_FAULT     9 // Lamps read back wrong; arg = read << 8 | written
+
+/* /proc/mytraffic/events is a sequence of these, oldest first. The file
+    offset counts records, so a reader that keeps the file open and reads
+    again only gets newer ones; if it falls more than the ring size behind,
+    the offset jumps past the records that were overwritten. */
+struct mytraffic_event {
+    __u64 timestamp_ns; // CLOCK_MONOTONIC
+    __u16 light; // Minor of the light
+    __u8 type; // MYTRAFFIC_EV_*
+    __u8 lamps; // MYTRAFFIC_LAMP_* bits lit when it was recorded
+    __u32 arg;
+};
+
+/* ioctl commands. Errors: EINVAL for a bad mode, format or program, or a request
+    the mode doesn't serve, ERANGE for a rate (0.1 to 50 Hz) or slack out of range, EBUSY for a
+    rate change on a corridor light, EIO for a mode other than flashing red on a light held
+    there by a lamp fault, ENOTTY for an unknown command */
+#define MYTRAFFIC_IOC_MAGIC 'L'
+#define MYTRAFFIC_IOC_SET_MODE    _IOW(MYTRAFFIC_IOC_MAGIC, 0x40, __u32)
+#define MYTRAFFIC_IOC_SET_RATE    _IOW(MYTRAFFIC_IOC_MAGIC, 0x41, __u32)
+#define MYTRAFFIC_IOC_TRIGGER_PED _IO(MYTRAFFIC_IOC_MAGIC, 0x42)
+#define MYTRAFFIC_IOC_GET_STATE   _IOR(MYTRAFFIC_IOC_MAGIC, 0x43, struct mytraffic_state)
+#define MYTRAFFIC_IOC_SET_CONFIG  _IOW(MYTRAFFIC_IOC_MAGIC, 0x44, struct mytraffic_config)
+#define MYTRAFFIC_IOC_SET_SLACK   _IOW(MYTRAFFIC_IOC_MAGIC, 0x45, struct mytraffic_slack)
+#define MYTRAFFIC_IOC_GET_SLACK   _IOWR(MYTRAFFIC_IOC_MAGIC, 0x46, struct mytraffic_slack)
+#define MYTRAFFIC_IOC_SET_FORMAT  _IOW(MYTRAFFIC_IOC_MAGIC, 0x47, __u32)
+#define MYTRAFFIC_IOC_SET_PROGRAM _IOW(MYTRAFFIC_IOC_MAGIC, 0x48, struct mytraffic_program)
+#define MYTRAFFIC_IOC_SET_RATE_MHZ _IOW(MYTRAFFIC_IOC_MAGIC, 0x49, __u32)
+
+#endif
@@ -0,0 +1,365 @@
+/* mytraffic state machine
+    The phase-plan logic of one signal head, with no timers, locks or GPIO,
+    so the same code runs in the module and in the user-space simulator
+    (mytraffic_sim.c). Time is counted in cycles: the caller decides when
+    cycles pass, drives the lamps and serializes every call on one fsm. */
+#ifndef MYTRAFFIC_FSM_H
+#define MYTRAFFIC_FSM_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/errno.h>
+#else
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+#endif
+
+#include "mytraffic.h"
+
+/* TRAFFIC LIGHT MODES:
+    Normal: Green -> Green -> Green -> Yellow -> Red -> Red ->
+    Flashing Red: Red -> Off -> Red -> Off ->
+    FLashing Yellow: Yellow -> Off -> Yellow -> Off ->
+*/
+enum mode {
+    NORMAL = MYTRAFFIC_MODE_NORMAL,
+    FLASHING_RED = MYTRAFFIC_MODE_FLASHING_RED,
+    FLASHING_YELLOW = MYTRAFFIC_MODE_FLASHING_YELLOW,
+    NUM_MODES
+};
+
+/* Lamp bitmask, one bit per light. Bit n drives lamp_desc[n], so a mask
+    maps bit by bit onto the values for gpiod_set_array_value() */
+#define LAMP_RED    MYTRAFFIC_LAMP_RED
+#define LAMP_YELLOW MYTRAFFIC_LAMP_YELLOW
+#define LAMP_GREEN  MYTRAFFIC_LAMP_GREEN
+#define NUM_LAMPS   3
+
+/* PHASE TABLES:
+    Each mode runs a plan: a cyclic list of phases, each lighting a set of
+    lamps for a number of cycles. A pending pedestrian request is served by
+    switching to the crossing plan at any cycle of a phase flagged PHASE_PED;
+    once the crossing plan has run through, the mode's plan restarts at phase 0.
+*/
+#define PHASE_PED 0x1 // Pending crossing may start during this phase
+#define MAX_PHASES 16
+#define PLAN_CROSSING NUM_MODES // Plan index of the pedestrian crossing
+#define NUM_PLANS (NUM_MODES + 1)
+
+struct phase {
+    u8 lamps; // LAMP_* bits lit during the phase
+    u8 flags; // PHASE_* flags
+    u16 ticks; // Length of the phase in cycles
+};
+
+struct phase_plan {
+    unsigned int len;
+    struct phase phases[MAX_PHASES];
+};
+
+static const char * const plan_names[NUM_PLANS] = {
+    "normal", "flashing-red", "flashing-yellow", "ped"
+};
+
+/* Default plans, matching the mode descriptions above.
+    A crossing shows red & yellow on the cycle it starts and five more. */
+static const struct phase_plan default_plans[NUM_PLANS] = {
+    [NORMAL] = { 3, {
+        { LAMP_GREEN,  0,         3 },
+        { LAMP_YELLOW, 0,         1 },
+        { LAMP_RED,    PHASE_PED, 2 } } },
+    [FLASHING_RED] = { 2, {
+        { LAMP_RED,    0,         1 },
+        { 0,           0,         1 } } },
+    [FLASHING_YELLOW] = { 2, {
+        { LAMP_YELLOW, 0,         1 },
+        { 0,           0,         1 } } },
+    [PLAN_CROSSING] = { 1, {
+        { LAMP_RED | LAMP_YELLOW, 0, 6 } } },
+};
+
+/* Where a signal head is in its plans */
+struct traffic_fsm {
+    enum mode current_mode;
+    struct phase_plan plans[NUM_PLANS];
+    unsigned int plan; // Plan being run: current_mode, or PLAN_CROSSING
+    unsigned int phase; // Index into the running plan
+    unsigned int phase_elapsed; // Cycles spent in the current phase
+    bool restart_plan; // Start the mode's plan afresh on the next cycle
+    bool ped_requested; // Pedestrian crossing requested
+    bool ped_kept; // ped_requested was made after restart_plan and outlives it
+    bool ped_crossing; // Pedestrian crossing in progress
+    int cycle_count; // Cycles since the mode or crossing last restarted
+    unsigned int green_pct; // Green phases run this percentage of their length
+    unsigned int cross_pct; // Likewise the crossing plan
+};
+
+/* What fsm_step() did besides moving through the plan */
+#define FSM_CROSSING_START 0x1
+#define FSM_CROSSING_END   0x2
+
+/* Start in NORMAL at the top of the default plans */
+static inline void fsm_init(struct traffic_fsm *fsm)
+{
+    unsigned int i;
+
+    fsm->current_mode = NORMAL;
+    for (i = 0; i < NUM_PLANS; i++) {
+        fsm->plans[i] = default_plans[i];
+    }
+    fsm->plan = NORMAL;
+    fsm->phase = 0;
+    fsm->phase_elapsed = 0;
+    fsm->restart_plan = false;
+    fsm->ped_requested = false;
+    fsm->ped_kept = false;
+    fsm->ped_crossing = false;
+    fsm->cycle_count = 0;
+    fsm->green_pct = 100;
+    fsm->cross_pct = 100;
+}
+
+/* The phase being shown */
+static inline const struct phase *fsm_phase(const struct traffic_fsm *fsm)
+{
+    return &fsm->plans[fsm->plan].phases[fsm->phase];
+}
+
+/* Length of phase ph of plan after scaling by green_pct or cross_pct, at
+    least one cycle */
+static inline unsigned int fsm_ticks(const struct traffic_fsm *fsm, unsigned int plan,
+                                     const struct phase *ph)
+{
+    unsigned int pct = plan == PLAN_CROSSING ? fsm->cross_pct :
+                       (ph->lamps & LAMP_GREEN) ? fsm->green_pct : 100;
+    unsigned int ticks;
+
+    if (pct == 100) {
+        return ph->ticks;
+    }
+    ticks = (ph->ticks * pct + 50) / 100;
+    return ticks ? ticks : 1;
+}
+
+/* Cycles phase ph of the running plan is held for. early_green, when not 0,
+    is the green a waiting pedestrian cuts it down to (early service). */
+static inline unsigned int fsm_phase_ticks(const struct traffic_fsm *fsm, const struct phase *ph,
+                                           unsigned int early_green)
+{
+    unsigned int ticks = fsm_ticks(fsm, fsm->plan, ph);
+
+    if (early_green && fsm->ped_requested && fsm->plan != PLAN_CROSSING &&
+        (ph->lamps & LAMP_GREEN) && early_green < ticks) {
+        return early_green;
+    }
+    return ticks;
+}
+
+/* Cycles until the next state change if nothing intervenes. A phase that
+    was shortened to less than it has already run ends on the next cycle. */
+static inline unsigned int fsm_remaining(const struct traffic_fsm *fsm, unsigned int early_green)
+{
+    unsigned int ticks = fsm_phase_ticks(fsm, fsm_phase(fsm), early_green);
+
+    return ticks > fsm->phase_elapsed ? ticks - fsm->phase_elapsed : 1;
+}
+
+/* True if the plan has a phase where a crossing can be served */
+static inline bool fsm_serves_ped(const struct phase_plan *plan)
+{
+    unsigned int i;
+
+    for (i = 0; i < plan->len; i++) {
+        if (plan->phases[i].flags & PHASE_PED) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Length of plan index in cycles, as scaled */
+static inline unsigned int fsm_plan_len(const struct traffic_fsm *fsm, unsigned int index)
+{
+    const struct phase_plan *plan = &fsm->plans[index];
+    unsigned int cycle = 0;
+    unsigned int i;
+
+    for (i = 0; i < plan->len; i++) {
+        cycle += fsm_ticks(fsm, index, &plan->phases[i]);
+    }
+    return cycle;
+}
+
+/* Length of the mode's plan in cycles */
+static inline unsigned int fsm_cycle_len(const struct traffic_fsm *fsm)
+{
+    return fsm_plan_len(fsm, fsm->current_mode);
+}
+
+/* Put the fsm pos cycles into its mode's plan */
+static inline void fsm_seek(struct traffic_fsm *fsm, unsigned int pos)
+{
+    const struct phase_plan *plan = &fsm->plans[fsm->current_mode];
+    unsigned int i, ticks;
+
+    for (i = 0; i + 1 < plan->len && pos >= fsm_ticks(fsm, fsm->current_mode, &plan->phases[i]); i++) {
+        pos -= fsm_ticks(fsm, fsm->current_mode, &plan->phases[i]);
+    }
+    ticks = fsm_ticks(fsm, fsm->current_mode, &plan->phases[i]);
+    fsm->plan = fsm->current_mode;
+    fsm->phase = i;
+    fsm->phase_elapsed = pos < ticks ? pos : ticks - 1u;
+}
+
+/* Advance by stride cycles, the time since the last step. When the mode's
+    plan starts over (after a mode change, a plan load or a crossing) it
+    resumes resync cycles in, or at phase 0 if resync is negative. Returns
+    FSM_* flags. */
+static inline unsigned int fsm_step(struct traffic_fsm *fsm, unsigned int stride, int resync,
+                                    unsigned int early_green)
+{
+    const struct phase_plan *plan;
+    const struct phase *ph;
+    unsigned int events = 0;
+    unsigned int ticks;
+
+    /* We slept through stride identical cycles */
+    fsm->cycle_count += stride;
+
+    if (fsm->restart_plan) {
+        /* Mode change or new table: run the mode's plan from its first phase,
+           abandoning any crossing that was waiting or in progress, but not
+           one requested of the new plan */
+        fsm->restart_plan = false;
+        fsm_seek(fsm, resync < 0 ? 0 : resync);
+        fsm->ped_requested = fsm->ped_kept;
+        fsm->ped_kept = false;
+        fsm->ped_crossing = false;
+    } else {
+        /* Move on once the phase has run its length. The next phase always
+           starts in full, however late this one ended (after a missed
+           wakeup, or a green cut or scaled below what it had already run):
+           cycles are skipped, never replayed, so no lamp is ever skipped. */
+        fsm->phase_elapsed += stride;
+        plan = &fsm->plans[fsm->plan];
+        ticks = fsm_phase_ticks(fsm, &plan->phases[fsm->phase], early_green);
+        if (fsm->phase_elapsed >= ticks) {
+            fsm->phase_elapsed = 0;
+            if (++fsm->phase == plan->len) {
+                fsm->phase = 0;
+            }
+            if (fsm->phase == 0 && fsm->plan == PLAN_CROSSING) {
+                /* Pedestrian Crossing completion -> back to the start of the mode's plan */
+                fsm->plan = fsm->current_mode;
+                fsm->ped_crossing = false;
+                fsm->ped_requested = false;
+                fsm->cycle_count = 0; // Reset cycle to beginning
+                events |= FSM_CROSSING_END;
+                if (resync >= 0) {
+                    fsm_seek(fsm, resync);
+                }
+            }
+        }
+    }
+
+    ph = fsm_phase(fsm);
+    if (fsm->ped_requested && (ph->flags & PHASE_PED)) {
+        /* If pedestrian mode requested, this stop cycle given to pedestrian mode */
+        fsm->plan = PLAN_CROSSING;
+        fsm->phase = 0;
+        fsm->phase_elapsed = 0;
+        fsm->ped_crossing = true;
+        fsm->ped_requested = false;
+        events |= FSM_CROSSING_START;
+    }
+    return events;
+}
+
+/* True if the fsm, just stepped onto the start of a phase of its mode's
+    plan with nothing pending, comes back to the same state every
+    fsm_cycle_len() cycles until something changes it */
+static inline bool fsm_periodic(const struct traffic_fsm *fsm)
+{
+    return fsm->plan == fsm->current_mode && fsm->phase_elapsed == 0 && !fsm->restart_plan &&
+           !fsm->ped_requested && !fsm->ped_crossing;
+}
+
+/* Scale green phases to green_pct and the crossing to cross_pct percent of
+    their planned length from now on. A crossing already running keeps the
+    length it started with. */
+static inline void fsm_adapt(struct traffic_fsm *fsm, unsigned int green_pct, unsigned int cross_pct)
+{
+    fsm->green_pct = green_pct;
+    if (!fsm->ped_crossing) {
+        fsm->cross_pct = cross_pct;
+    }
+}
+
+/* Switch to a new mode from the next cycle on */
+static inline void fsm_set_mode(struct traffic_fsm *fsm, enum mode mode)
+{
+    fsm->current_mode = mode;
+    fsm->cycle_count = 0;
+    fsm->restart_plan = true;
+    fsm->ped_kept = false;
+}
+
+/* Replace a plan. Returns true if the running plan changed under the fsm,
+    which then starts it over on the next cycle. */
+static inline bool fsm_load_plan(struct traffic_fsm *fsm, unsigned int index,
+                                 const struct phase_plan *plan)
+{
+    fsm->plans[index] = *plan;
+    if (index != fsm->plan) {
+        return false;
+    }
+    fsm->restart_plan = true;
+    fsm->ped_kept = false;
+    return true;
+}
+
+/* Register a pedestrian request. Only a mode whose plan serves crossings
+    (NORMAL by default) accepts one. Returns -EINVAL if refused, 1 for a new
+    request and 0 for a repeat. A request made once a mode change or plan
+    load is pending is for the new plan and is kept when it starts. *wake is set to the cycles after the last
+    step by which the caller should step again to serve it on time, or 0
+    if the step already due is soon enough. */
+static inline int fsm_request_ped(struct traffic_fsm *fsm, unsigned int early_green,
+                                  unsigned int *wake)
+{
+    const struct phase *ph = fsm_phase(fsm);
+    bool was_requested = fsm->ped_requested;
+    unsigned int cut;
+
+    *wake = 0;
+    if (!fsm_serves_ped(&fsm->plans[fsm->current_mode])) {
+        return -EINVAL;
+    }
+    fsm->ped_requested = true;
+    if (fsm->restart_plan) {
+        was_requested = fsm->ped_kept;
+        fsm->ped_kept = true;
+        return !was_requested;
+    }
+    if (fsm->ped_crossing) {
+        return !was_requested;
+    }
+
+    /* A request during a crossing phase is served on its next cycle,
+       so wake for it instead of sleeping through the whole phase */
+    cut = fsm_phase_ticks(fsm, ph, early_green);
+    if (ph->flags & PHASE_PED) {
+        *wake = 1;
+    } else if (cut < fsm_ticks(fsm, fsm->plan, ph)) {
+        /* Early service: end this green, as scaled, at early_green */
+        *wake = cut > fsm->phase_elapsed ? cut - fsm->phase_elapsed : 1;
+    }
+    return !was_requested;
+}
+
+#endif
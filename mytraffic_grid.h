@@ -0,0 +1,166 @@
+/* mytraffic tick grid
+    The arithmetic that turns a light's cycle rate into absolute deadlines,
+    with no timers or locks, so the module and the user-space simulator
+    (mytraffic_sim.c) lay out the same wakeups. Times are CLOCK_MONOTONIC
+    nanoseconds in a ktime_t; the caller passes now and serializes every
+    call on one grid. */
+#ifndef MYTRAFFIC_GRID_H
+#define MYTRAFFIC_GRID_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/gcd.h>
+#else
+#include <stdint.h>
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int64_t ktime_t;
+#define NSEC_PER_SEC 1000000000L
+
+static inline u64 div_u64(u64 dividend, u32 divisor)
+{
+    return dividend / divisor;
+}
+
+static inline u64 mul_u64_u32_div(u64 a, u32 mul, u32 divisor)
+{
+    return (unsigned __int128)a * mul / divisor;
+}
+
+static inline unsigned long gcd(unsigned long a, unsigned long b)
+{
+    while (b) {
+        unsigned long r = a % b;
+
+        a = b;
+        b = r;
+    }
+    return a;
+}
+#endif
+
+/* Cycle rate limits in mHz: 0.1 to 50 Hz */
+#define MIN_RATE_MHZ 100
+#define MAX_RATE_MHZ 50000
+
+/* Where a light's wakeups fall at its cycle rate. Tick n is due at
+    epoch + n / rate seconds, computed exactly rather than by summing a rounded
+    period. */
+struct traffic_grid {
+    ktime_t epoch; // Deadline that tick 0 of the current rate grid fell on
+    unsigned int ticks; // Grid tick the timer is armed for
+    unsigned int wake_ticks; // Grid tick of the most recent wakeup
+    unsigned int grid_mhz; // Rate the epoch/ticks grid was laid out for
+    unsigned int stride; // Cycles from the most recent wakeup to ticks
+};
+
+/* Time ticks cycles take at rate_mhz. Exact up to about 1.8e7 ticks. */
+static inline u64 grid_ticks_ns(u64 ticks, unsigned int rate_mhz)
+{
+    return div_u64(ticks * (1000 * NSEC_PER_SEC), rate_mhz);
+}
+
+/* Whole cycles at rate_mhz in ns, rounded down; exact for any ns */
+static inline u64 grid_ns_ticks(u64 ns, unsigned int rate_mhz)
+{
+    return div_u64(mul_u64_u32_div(ns, rate_mhz, 1000), NSEC_PER_SEC);
+}
+
+/* Absolute deadline of the tick the grid currently points at */
+static inline ktime_t grid_deadline(const struct traffic_grid *grid)
+{
+    return grid->epoch + grid_ticks_ns(grid->ticks, grid->grid_mhz);
+}
+
+/* Start the grid over at epoch, woken on its tick 0 */
+static inline void grid_start(struct traffic_grid *grid, ktime_t epoch, unsigned int rate_mhz)
+{
+    grid->epoch = epoch;
+    grid->ticks = 0;
+    grid->wake_ticks = 0;
+    grid->grid_mhz = rate_mhz;
+}
+
+/* A whole number of ticks always spans a whole number of seconds (rate_mhz / g
+    ticks take 1000 / g s, g being their gcd), so those are folded into the
+    epoch to keep the product small. No deadline moves. */
+static inline void grid_fold(struct traffic_grid *grid)
+{
+    unsigned int g = gcd(grid->grid_mhz, 1000);
+    unsigned int fold = grid->grid_mhz / g;
+    unsigned int n = grid->wake_ticks / fold;
+
+    grid->epoch += (u64)n * (1000 / g) * NSEC_PER_SEC;
+    grid->wake_ticks -= n * fold;
+    grid->ticks -= n * fold;
+}
+
+/* Lay the grid out at rate_mhz from epoch, woken on tick wake and armed for
+    tick ticks, which may be any distance from epoch */
+static inline void grid_lay(struct traffic_grid *grid, ktime_t epoch, u64 wake, u64 ticks,
+                            unsigned int rate_mhz)
+{
+    unsigned int g = gcd(rate_mhz, 1000);
+    u64 fold = rate_mhz / g;
+    u64 n = wake / fold;
+
+    grid->epoch = epoch + (ktime_t)(n * (1000 / g)) * NSEC_PER_SEC;
+    grid->wake_ticks = wake - n * fold;
+    grid->ticks = ticks - n * fold;
+    grid->grid_mhz = rate_mhz;
+    grid->stride = ticks - wake;
+}
+
+/* Arm the grid stride cycles after the tick that just fired, at rate_mhz,
+    and return the deadline. A rate change re-anchors the grid on that tick.
+    If we were held off past the deadline the missed ticks are skipped, not
+    replayed, so the lamps never race to catch up. */
+static inline ktime_t grid_schedule(struct traffic_grid *grid, unsigned int rate_mhz,
+                                    unsigned int stride, ktime_t now)
+{
+    if (grid->grid_mhz != rate_mhz) {
+        grid_start(grid, grid_deadline(grid), rate_mhz);
+    }
+    grid->wake_ticks = grid->ticks;
+    grid_fold(grid);
+
+    grid->stride = stride;
+    grid->ticks += stride;
+    while (grid_deadline(grid) <= now) {
+        grid->ticks++;
+    }
+    return grid_deadline(grid);
+}
+
+/* Re-arm the grid stride cycles after the last wakeup, or on the first tick
+    after now if that has passed, and return the deadline */
+static inline ktime_t grid_reschedule(struct traffic_grid *grid, unsigned int stride, ktime_t now)
+{
+    grid->ticks = grid->wake_ticks + stride;
+    while (grid_deadline(grid) <= now) {
+        grid->ticks++;
+    }
+    grid->stride = grid->ticks - grid->wake_ticks;
+    return grid_deadline(grid);
+}
+
+/* Move a grid armed for next, still in the future, from old_mhz to
+    new_mhz at now and return the new deadline. The fraction of the stride
+    being slept through is kept: what is left of it is stretched or squeezed
+    to the new rate, and the grid is laid out again so the wakeup that
+    started it sits stride cycles before the new deadline, as if the light
+    had always run at this rate. */
+static inline ktime_t grid_set_rate(struct traffic_grid *grid, unsigned int old_mhz,
+                                    unsigned int new_mhz, ktime_t next, ktime_t now)
+{
+    next = now + mul_u64_u32_div(next - now, old_mhz, new_mhz);
+    grid->epoch = next - grid_ticks_ns(grid->stride, new_mhz);
+    grid->grid_mhz = new_mhz;
+    grid->wake_ticks = 0;
+    grid->ticks = grid->stride;
+    return next;
+}
+
+#endif
@@ -0,0 +1,396 @@
+/* mytraffic_sim: the mytraffic state machine in user space
+    Drives mytraffic_fsm.h and mytraffic_grid.h the way the module's timer
+    does, against mock lamps and a virtual clock counted in cycles, with
+    random pedestrian presses, mode toggles, rate changes and plan loads
+    thrown in. Every step is checked against the invariants below, and the
+    run reports how fast the state machine went.
+
+    The fsm's cycles and the grid's nanoseconds are kept apart: the timer is
+    due when the grid's deadline is reached, and that must be the cycle the
+    fsm asked for. Rate changes go through the grid as set_rate_locked()
+    does, most while the light sleeps and some on the tick it is due.
+
+    Invariants:
+    - red and green are never lit together
+    - in NORMAL, green never changes straight to red unless the plan restarted
+    - a request made in NORMAL is served within one cycle of the plan (at
+      its longest green under -a) plus one, unless a mode change or plan
+      load cancelled it; one made together with a switch to NORMAL, as
+      MYTRAFFIC_IOC_SET_CONFIG does, is served the same way
+    - a crossing that is not cut off by a mode change runs its full length
+    - the next state change is always at least one cycle away
+    - deadlines only move forward, and each falls exactly on a tick of the
+      rate in force, counted from the last rate change on a reference the
+      simulator keeps without the grid's folding
+
+    With -a the green and crossing lengths are scaled from recent demand the
+    way the module's adaptive parameter does, within the default bounds.
+
+    usage: mytraffic_sim [-n cycles] [-s seed] [-p presses per 1000 cycles]
+                         [-e min_green] [-a] [-q]
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mytraffic_fsm.h"
+#include "mytraffic_grid.h"
+
+static struct traffic_fsm fsm;
+static u8 lamps; // Mock GPIO: LAMP_* bits lit
+static u64 now; // Virtual clock, in cycles
+static u64 wake; // Cycle of the last step
+static u64 next_step; // Cycle the fsm wants its next step on
+static struct traffic_grid grid; // Mock light->grid
+static ktime_t next_event; // Deadline the grid armed the timer for
+static unsigned int rate_mhz = 1000;
+static ktime_t sim_ns; // Simulated time
+
+/* Cycle ref_cycle began at ref_ns and the rate has not changed since; every
+    tick after it is due an exact number of periods later */
+static ktime_t ref_ns;
+static u64 ref_cycle;
+static unsigned int early; // early_green passed to the fsm, 0 for off
+static bool adapt; // Scale phases from demand, like the adaptive parameter
+
+/* Adaptive timing, as the module's defaults with the window in cycles */
+#define ARRIVALS 32
+#define ADAPT_WINDOW 120
+#define ADAPT_BUSY 10
+static const unsigned int adapt_green[2] = { 50, 200 };
+static const unsigned int adapt_cross[2] = { 100, 200 };
+static u64 arrivals[ARRIVALS];
+static unsigned int nr_arrivals;
+static u64 rng = 0x9e3779b97f4a7c15ull;
+
+/* Request bookkeeping for the service-time invariant */
+static bool waiting; // A request made in NORMAL is pending
+static u64 pressed_at;
+static u64 crossing_at;
+static unsigned int crossing_len; // Length the running crossing started with
+
+/* Results */
+static u64 steps, transitions, crossings, presses, toggles, configs, rate_changes, plan_loads;
+static u64 served, wait_sum, wait_max;
+
+static u64 xorshift(void)
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+/* True with probability per_mille / 1000 */
+static bool chance(unsigned int per_mille)
+{
+    return xorshift() % 1000 < per_mille;
+}
+
+static void fail(const char *what)
+{
+    fprintf(stderr, "mytraffic_sim: cycle %llu: %s (mode %s, plan %s, phase %u)\n",
+            (unsigned long long)now, what, plan_names[fsm.current_mode],
+            plan_names[fsm.plan], fsm.phase);
+    exit(1);
+}
+
+/* Mock of adapt_timing(): interpolate between the idle and busy ends of
+    the bounds by the requests made in the last ADAPT_WINDOW cycles */
+static void adapt_timing(void)
+{
+    unsigned int n = 0;
+    unsigned int i;
+
+    if (!adapt) {
+        return;
+    }
+    for (i = 0; i < nr_arrivals && i < ARRIVALS; i++) {
+        if (arrivals[i] + ADAPT_WINDOW > now) {
+            n++;
+        }
+    }
+    if (n > ADAPT_BUSY) {
+        n = ADAPT_BUSY;
+    }
+    fsm_adapt(&fsm, (adapt_green[1] * (ADAPT_BUSY - n) + adapt_green[0] * n) / ADAPT_BUSY,
+              (adapt_cross[0] * (ADAPT_BUSY - n) + adapt_cross[1] * n) / ADAPT_BUSY);
+}
+
+/* Longest the mode's plan can run, greens stretched as far as they go */
+static unsigned int longest_cycle(void)
+{
+    struct traffic_fsm longest = fsm;
+
+    if (adapt) {
+        longest.green_pct = adapt_green[1];
+    }
+    return fsm_cycle_len(&longest);
+}
+
+/* Mock of write_lamps() */
+static void set_lamps(u8 mask)
+{
+    if ((mask & LAMP_RED) && (mask & LAMP_GREEN)) {
+        fail("red and green lit together");
+    }
+    if (mask != lamps) {
+        transitions++;
+    }
+    lamps = mask;
+}
+
+/* When cycle c begins on the reference grid */
+static ktime_t cycle_ns(u64 c)
+{
+    return ref_ns + (ktime_t)((unsigned __int128)(c - ref_cycle) * 1000000000000ull / rate_mhz);
+}
+
+/* The grid just armed the timer for cycle next_step */
+static void armed(ktime_t deadline)
+{
+    if (deadline <= sim_ns) {
+        fail("deadline not after now");
+    }
+    if (deadline != cycle_ns(next_step)) {
+        fail("deadline off the tick grid");
+    }
+    next_event = deadline;
+}
+
+/* Mock of reschedule_next_tick(): stride cycles after the last step, or the
+    first cycle after now if that has passed */
+static void reschedule(unsigned int stride)
+{
+    next_step = wake + stride;
+    if (next_step <= now) {
+        next_step = now + 1;
+    }
+    armed(grid_reschedule(&grid, stride, sim_ns));
+}
+
+/* Mock of set_rate_locked(). A light due this instant has its grid moved
+    by the step about to run instead, anchored on the tick it fires. */
+static void set_rate(unsigned int mhz)
+{
+    unsigned int old_mhz = rate_mhz;
+
+    rate_changes++;
+    rate_mhz = mhz;
+    if (next_event > sim_ns) {
+        next_event = grid_set_rate(&grid, old_mhz, mhz, next_event, sim_ns);
+        ref_ns = grid.epoch;
+        ref_cycle = wake;
+        if (next_event != cycle_ns(next_step)) {
+            fail("rate change moved the deadline off the tick grid");
+        }
+    } else if (grid.grid_mhz != mhz) {
+        ref_ns = next_event;
+        ref_cycle = now;
+    }
+}
+
+/* The timer fired at cycle now: what step_light() does, minus the kernel */
+static void step(void)
+{
+    bool restarted = fsm.restart_plan;
+    bool kept = fsm.ped_kept;
+    u8 before = lamps;
+    unsigned int events;
+    unsigned int left;
+
+    adapt_timing();
+    if (grid.stride != now - wake) {
+        fail("grid stride is not the cycles since the last step");
+    }
+    events = fsm_step(&fsm, grid.stride, -1, early);
+    wake = now;
+    steps++;
+
+    if (restarted && !kept) {
+        waiting = false;
+    }
+    if (restarted && kept && !fsm.ped_requested && !(events & FSM_CROSSING_START)) {
+        fail("request made with the mode change dropped");
+    }
+    if (events & FSM_CROSSING_END) {
+        if (!restarted && now - crossing_at != crossing_len) {
+            fail("crossing cut short");
+        }
+    }
+    if (events & FSM_CROSSING_START) {
+        if (waiting) {
+            u64 wait = now - pressed_at;
+
+            if (wait > longest_cycle() + 1) {
+                fail("pedestrian waited longer than a cycle");
+            }
+            served++;
+            wait_sum += wait;
+            if (wait > wait_max) {
+                wait_max = wait;
+            }
+            waiting = false;
+        }
+        crossing_at = now;
+        crossing_len = fsm_plan_len(&fsm, PLAN_CROSSING);
+        crossings++;
+    }
+
+    set_lamps(fsm_phase(&fsm)->lamps);
+    if (fsm.current_mode == NORMAL && !restarted &&
+        (before & LAMP_GREEN) && (lamps & LAMP_RED)) {
+        fail("green went straight to red");
+    }
+
+    left = fsm_remaining(&fsm, early);
+    if (left == 0) {
+        fail("next state change not in the future");
+    }
+    next_step = now + left;
+    armed(grid_schedule(&grid, rate_mhz, left, sim_ns));
+}
+
+/* A NORMAL plan with random phase lengths, valid as parse_plan() would
+    accept it */
+static void load_random_plan(void)
+{
+    struct phase_plan plan = { 3, {
+        { LAMP_GREEN,  0,         1 + xorshift() % 5 },
+        { LAMP_YELLOW, 0,         1 + xorshift() % 2 },
+        { LAMP_RED,    PHASE_PED, 1 + xorshift() % 3 } } };
+
+    plan_loads++;
+    waiting = false;
+    if (fsm_load_plan(&fsm, NORMAL, &plan)) {
+        reschedule(1);
+    }
+}
+
+/* Press the pedestrian button */
+static void press(void)
+{
+    unsigned int w;
+    int result;
+
+    presses++;
+    result = fsm_request_ped(&fsm, early, &w);
+    if (result > 0 && (fsm.restart_plan || !fsm.ped_crossing)) {
+        waiting = true;
+        pressed_at = now;
+    }
+    if (result > 0 && adapt) {
+        arrivals[nr_arrivals++ % ARRIVALS] = now;
+        adapt_timing();
+        if (fsm_remaining(&fsm, early) < next_step - wake &&
+            (!w || fsm_remaining(&fsm, early) < w)) {
+            w = fsm_remaining(&fsm, early);
+        }
+    }
+    if (w) {
+        reschedule(w);
+    }
+}
+
+/* Things that happen some time during cycle now */
+static void inputs(unsigned int press_rate)
+{
+    if (chance(press_rate)) {
+        press();
+    }
+    if (chance(1)) {
+        toggles++;
+        waiting = false;
+        fsm_set_mode(&fsm, (fsm.current_mode + 1) % NUM_MODES);
+        reschedule(1);
+    }
+    if (chance(1)) {
+        /* MYTRAFFIC_CFG_MODE | MYTRAFFIC_CFG_PED in one ioctl */
+        configs++;
+        waiting = false;
+        fsm_set_mode(&fsm, NORMAL);
+        reschedule(1);
+        press();
+        if (!waiting) {
+            fail("request made with a switch to NORMAL refused");
+        }
+    }
+    if (chance(1)) {
+        set_rate(MIN_RATE_MHZ + xorshift() % (MAX_RATE_MHZ - MIN_RATE_MHZ + 1));
+    }
+    if (xorshift() % 10000 == 0) {
+        load_random_plan();
+    }
+}
+
+int main(int argc, char **argv)
+{
+    u64 cycles = 10000000;
+    unsigned int press_rate = 50;
+    bool quiet = false;
+    struct timespec t0, t1;
+    double secs;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:s:p:e:aq")) != -1) {
+        switch (opt) {
+            case 'n': cycles = strtoull(optarg, NULL, 0); break;
+            case 's': rng = strtoull(optarg, NULL, 0) | 1; break;
+            case 'p': press_rate = strtoul(optarg, NULL, 0); break;
+            case 'e': early = strtoul(optarg, NULL, 0); break;
+            case 'a': adapt = true; break;
+            case 'q': quiet = true; break;
+            default:
+                fprintf(stderr, "usage: %s [-n cycles] [-s seed] [-p presses per 1000 cycles] "
+                        "[-e min_green] [-a] [-q]\n", argv[0]);
+                return 2;
+        }
+    }
+
+    fsm_init(&fsm);
+    lamps = fsm_phase(&fsm)->lamps;
+    next_step = fsm_remaining(&fsm, early);
+    grid_start(&grid, 0, rate_mhz);
+    grid.stride = grid.ticks = next_step;
+    next_event = grid_deadline(&grid);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (now = 0; now < cycles; now++) {
+        sim_ns = cycle_ns(now);
+        if (xorshift() % 1000 == 0) {
+            set_rate(MIN_RATE_MHZ + xorshift() % (MAX_RATE_MHZ - MIN_RATE_MHZ + 1));
+        }
+        if (next_event <= cycle_ns(now)) {
+            if (now != next_step || next_event != cycle_ns(now)) {
+                fail("timer due on another cycle than the fsm asked for");
+            }
+            sim_ns = next_event;
+            step();
+        } else if (now == next_step) {
+            fail("timer not due on the cycle the fsm asked for");
+        }
+        /* Inputs come half way through the cycle */
+        sim_ns = cycle_ns(now) + (cycle_ns(now + 1) - cycle_ns(now)) / 2;
+        inputs(press_rate);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+    if (!quiet) {
+        printf("cycles:        %llu (%.1f h simulated)\n",
+               (unsigned long long)cycles, sim_ns / 3.6e12);
+        printf("steps:         %llu\n", (unsigned long long)steps);
+        printf("transitions:   %llu\n", (unsigned long long)transitions);
+        printf("inputs:        %llu presses, %llu toggles, %llu mode+ped configs, "
+               "%llu rate changes, %llu plan loads\n",
+               (unsigned long long)presses, (unsigned long long)toggles, (unsigned long long)configs,
+               (unsigned long long)rate_changes, (unsigned long long)plan_loads);
+        printf("crossings:     %llu, wait mean %.2f max %llu cycles\n",
+               (unsigned long long)crossings,
+               served ? (double)wait_sum / served : 0.0, (unsigned long long)wait_max);
+    }
+    printf("%.3f s: %.1f M cycles/s, %.1f M steps/s, %.1f M transitions/s\n", secs,
+           cycles / secs / 1e6, steps / secs / 1e6, transitions / secs / 1e6);
+    return 0;
+}
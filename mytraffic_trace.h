@@ -0,0 +1,121 @@
+/* mytraffic tracepoints
+    Enable with: echo 1 > /sys/kernel/debug/tracing/events/mytraffic/enable
+    Each costs a patched-out branch while disabled. */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM mytraffic
+
+#if !defined(_MYTRAFFIC_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _MYTRAFFIC_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/* Lamps changed: the light entered phase of plan */
+TRACE_EVENT(mytraffic_state,
+    TP_PROTO(unsigned int light, unsigned int plan, unsigned int phase, unsigned int lamps),
+    TP_ARGS(light, plan, phase, lamps),
+    TP_STRUCT__entry(
+        __field(unsigned int, light)
+        __field(unsigned int, plan)
+        __field(unsigned int, phase)
+        __field(unsigned int, lamps)
+    ),
+    TP_fast_assign(
+        __entry->light = light;
+        __entry->plan = plan;
+        __entry->phase = phase;
+        __entry->lamps = lamps;
+    ),
+    TP_printk("light=%u plan=%u phase=%u lamps=%c%c%c",
+              __entry->light, __entry->plan, __entry->phase,
+              __entry->lamps & 0x1 ? 'R' : '-',
+              __entry->lamps & 0x2 ? 'Y' : '-',
+              __entry->lamps & 0x4 ? 'G' : '-')
+);
+
+/* A button press got past the debounce */
+TRACE_EVENT(mytraffic_button,
+    TP_PROTO(unsigned int light, int gpio),
+    TP_ARGS(light, gpio),
+    TP_STRUCT__entry(
+        __field(unsigned int, light)
+        __field(int, gpio)
+    ),
+    TP_fast_assign(
+        __entry->light = light;
+        __entry->gpio = gpio;
+    ),
+    TP_printk("light=%u gpio=%d", __entry->light, __entry->gpio)
+);
+
+/* Pedestrian request registered (0), crossing started (1) or completed (2) */
+TRACE_EVENT(mytraffic_ped,
+    TP_PROTO(unsigned int light, unsigned int what),
+    TP_ARGS(light, what),
+    TP_STRUCT__entry(
+        __field(unsigned int, light)
+        __field(unsigned int, what)
+    ),
+    TP_fast_assign(
+        __entry->light = light;
+        __entry->what = what;
+    ),
+    TP_printk("light=%u %s", __entry->light,
+              __entry->what == 0 ? "requested" :
+              __entry->what == 1 ? "crossing" : "complete")
+);
+
+/* Mode switched, takes effect on the next cycle */
+TRACE_EVENT(mytraffic_mode,
+    TP_PROTO(unsigned int light, unsigned int mode),
+    TP_ARGS(light, mode),
+    TP_STRUCT__entry(
+        __field(unsigned int, light)
+        __field(unsigned int, mode)
+    ),
+    TP_fast_assign(
+        __entry->light = light;
+        __entry->mode = mode;
+    ),
+    TP_printk("light=%u mode=%u", __entry->light, __entry->mode)
+);
+
+/* Cycle rate changed, in mHz */
+TRACE_EVENT(mytraffic_rate,
+    TP_PROTO(unsigned int light, unsigned int rate_mhz),
+    TP_ARGS(light, rate_mhz),
+    TP_STRUCT__entry(
+        __field(unsigned int, light)
+        __field(unsigned int, rate_mhz)
+    ),
+    TP_fast_assign(
+        __entry->light = light;
+        __entry->rate_mhz = rate_mhz;
+    ),
+    TP_printk("light=%u rate=%u.%03u", __entry->light,
+              __entry->rate_mhz / 1000, __entry->rate_mhz % 1000)
+);
+
+/* New phase table loaded into plan */
+TRACE_EVENT(mytraffic_plan,
+    TP_PROTO(unsigned int light, unsigned int plan, unsigned int len),
+    TP_ARGS(light, plan, len),
+    TP_STRUCT__entry(
+        __field(unsigned int, light)
+        __field(unsigned int, plan)
+        __field(unsigned int, len)
+    ),
+    TP_fast_assign(
+        __entry->light = light;
+        __entry->plan = plan;
+        __entry->len = len;
+    ),
+    TP_printk("light=%u plan=%u phases=%u", __entry->light, __entry->plan, __entry->len)
+);
+
+#endif /* _MYTRAFFIC_TRACE_H */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#define TRACE_INCLUDE_FILE mytraffic_trace
+#include <trace/define_trace.h>
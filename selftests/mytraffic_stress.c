@@ -0,0 +1,665 @@
+/* mytraffic_stress: load and IRQ storm tests for a loaded mytraffic module
+    Runs on the target against /dev/mytraffic, in the manner of a kselftest:
+    TAP on stdout, and one JSON object per measurement in the results file so
+    runs on different kernels or builds can be compared.
+
+    Tests:
+    - rate_sweep: timer lateness from /proc/mytraffic/latency at each rate;
+      fails if the light woke for fewer than half its state changes
+    - edge_storm: rising edges at a fixed rate on the toggle and pedestrian
+      buttons, and what handling them cost: IRQs taken, hard and soft IRQ
+      time, IRQ thread time, presses accepted and dropped by debounce.
+      Ten edges a second are held high past debounce_us, so they must get
+      through; fails if any of those was lost, or if more presses got
+      through than one per debounce_us
+    - concurrency: blocking readers, an mmap sampler and writers sweeping
+      every rate, switching modes and pressing for a crossing, all at once
+    Each also fails if the timer ran more than -L microseconds late.
+
+    Edges are made by writing 1 then 0 to a file driving the button's line:
+    a gpio-mockup line in debugfs, or the value of an output GPIO wired back
+    to the button (see run_stress.sh). Without -T and -P edge_storm is
+    skipped.
+
+    usage: mytraffic_stress [-d device] [-t seconds] [-f edge Hz] [-r readers]
+                            [-w writers] [-T toggle line] [-P ped line]
+                            [-L max late us] [-j results file]
+*/
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../mytraffic.h"
+
+#define LATENCY_FILE "/proc/mytraffic/latency"
+#define COUNTERS_FILE "/sys/kernel/debug/mytraffic/light0"
+#define CONFIG_FILE "/proc/mytraffic/config"
+
+static const char *device = "/dev/mytraffic";
+static unsigned int seconds = 5;
+static unsigned int edge_hz = 1000;
+static unsigned int nr_readers = 4;
+static unsigned int nr_writers = 2;
+static unsigned int max_late_us = 1000;
+static const char *line_path[2]; // Toggle, pedestrian
+static const char * const button_names[2] = { "toggle", "ped" };
+static const char * const irq_names[2] = { "toggle_button_handler", "ped_button_handler" };
+static FILE *results;
+static unsigned int test_nr;
+static unsigned int failures;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void tap(bool ok, const char *what)
+{
+    printf("%s %u %s\n", ok ? "ok" : "not ok", ++test_nr, what);
+    if (!ok) {
+        failures++;
+    }
+}
+
+static void tap_skip(const char *what, const char *why)
+{
+    printf("ok %u %s # SKIP %s\n", ++test_nr, what, why);
+}
+
+/* Timer lateness since the last reset */
+struct latency {
+    uint64_t samples, min_ns, mean_ns, max_ns;
+};
+
+static void latency_reset(void)
+{
+    int fd = open(LATENCY_FILE, O_WRONLY);
+
+    if (fd >= 0) {
+        if (write(fd, "0\n", 2) < 0) {
+            perror(LATENCY_FILE);
+        }
+        close(fd);
+    }
+}
+
+static void latency_read(struct latency *lat)
+{
+    char line[128];
+    FILE *f = fopen(LATENCY_FILE, "r");
+
+    memset(lat, 0, sizeof(*lat));
+    if (!f) {
+        return;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        unsigned long long v;
+
+        if (sscanf(line, "samples: %llu", &v) == 1) {
+            lat->samples = v;
+        } else if (sscanf(line, "min: %llu ns", &v) == 1) {
+            lat->min_ns = v;
+        } else if (sscanf(line, "mean: %llu ns", &v) == 1) {
+            lat->mean_ns = v;
+        } else if (sscanf(line, "max: %llu ns", &v) == 1) {
+            lat->max_ns = v;
+        }
+    }
+    fclose(f);
+}
+
+/* Whether the timer kept within max_late_us, saying so if not */
+static bool latency_ok(const char *what, const struct latency *lat)
+{
+    if (lat->max_ns <= (uint64_t)max_late_us * 1000) {
+        return true;
+    }
+    printf("# %s: timer %llu ns late, limit %u us\n", what,
+           (unsigned long long)lat->max_ns, max_late_us);
+    return false;
+}
+
+/* debounce_us the module runs with, 0 if unknown */
+static unsigned int debounce_read(void)
+{
+    char line[128];
+    unsigned int us = 0;
+    FILE *f = fopen(CONFIG_FILE, "r");
+
+    if (!f) {
+        return 0;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        sscanf(line, "debounce_us=%u", &us);
+    }
+    fclose(f);
+    return us;
+}
+
+static void json_latency(const struct latency *lat)
+{
+    fprintf(results, ",\"latency_samples\":%llu,\"latency_min_ns\":%llu,"
+            "\"latency_mean_ns\":%llu,\"latency_max_ns\":%llu}\n",
+            (unsigned long long)lat->samples, (unsigned long long)lat->min_ns,
+            (unsigned long long)lat->mean_ns, (unsigned long long)lat->max_ns);
+    fflush(results);
+}
+
+static int get_state(int fd, struct mytraffic_state *st)
+{
+    return ioctl(fd, MYTRAFFIC_IOC_GET_STATE, st);
+}
+
+static int set_mode(int fd, unsigned int mode)
+{
+    return ioctl(fd, MYTRAFFIC_IOC_SET_MODE, &mode);
+}
+
+static int set_rate_mhz(int fd, unsigned int rate_mhz)
+{
+    return ioctl(fd, MYTRAFFIC_IOC_SET_RATE_MHZ, &rate_mhz);
+}
+
+/* rate_sweep: seconds at each rate, timer lateness over each. The default
+    NORMAL plan changes state three times in six cycles, and adaptive timing
+    stretches that to nine at most, so a light that keeps time wakes at
+    least seconds * rate / 3 times; a quarter of seconds * rate is the floor. */
+static void test_rate_sweep(int fd)
+{
+    static const unsigned int rates_mhz[] = { 500, 1000, 2000, 5000, 10000, 20000, 50000 };
+    struct mytraffic_state st;
+    struct latency lat;
+    uint64_t expected;
+    bool ok = true;
+    unsigned int i;
+
+    for (i = 0; i < sizeof(rates_mhz) / sizeof(rates_mhz[0]); i++) {
+        if (set_rate_mhz(fd, rates_mhz[i]) || get_state(fd, &st) || st.rate_mhz != rates_mhz[i]) {
+            printf("# rate %u mHz not applied\n", rates_mhz[i]);
+            ok = false;
+            continue;
+        }
+        latency_reset();
+        sleep(seconds);
+        latency_read(&lat);
+        printf("# rate %u mHz: %llu wakeups, mean %llu ns, max %llu ns late\n", rates_mhz[i],
+               (unsigned long long)lat.samples, (unsigned long long)lat.mean_ns,
+               (unsigned long long)lat.max_ns);
+        fprintf(results, "{\"test\":\"rate_sweep\",\"rate_mhz\":%u", rates_mhz[i]);
+        json_latency(&lat);
+        expected = (uint64_t)seconds * rates_mhz[i] / 4000;
+        if (lat.samples < (expected ? expected : 1)) {
+            printf("# rate %u mHz: expected at least %llu wakeups\n", rates_mhz[i],
+                   (unsigned long long)(expected ? expected : 1));
+            ok = false;
+        }
+        if (!latency_ok("rate_sweep", &lat)) {
+            ok = false;
+        }
+    }
+    set_rate_mhz(fd, 1000);
+    tap(ok, "rate_sweep");
+}
+
+/* What handling a button's IRQ cost, summed over CPUs */
+struct irq_cost {
+    uint64_t irqs; // From /proc/interrupts
+    uint64_t irq_ns, softirq_ns; // Whole system, from /proc/stat
+    uint64_t thread_ns; // The button's IRQ thread
+    unsigned long presses, dropped; // The module's counters
+};
+
+/* IRQ number and count of the handler named name, -1 if not found */
+static int irq_lookup(const char *name, uint64_t *count)
+{
+    char line[1024];
+    FILE *f = fopen("/proc/interrupts", "r");
+    int irq = -1;
+
+    *count = 0;
+    if (!f) {
+        return -1;
+    }
+    while (irq < 0 && fgets(line, sizeof(line), f)) {
+        char *p = line, *end;
+        long n = strtol(p, &end, 10);
+
+        if (end == p || *end != ':' || !strstr(line, name)) {
+            continue;
+        }
+        irq = n;
+        for (p = end + 1;; p = end) {
+            unsigned long long c = strtoull(p, &end, 10);
+
+            if (end == p) {
+                break;
+            }
+            *count += c;
+        }
+    }
+    fclose(f);
+    return irq;
+}
+
+/* CPU time of the thread named irq/<irq>-..., 0 if there is none */
+static uint64_t irq_thread_ns(int irq)
+{
+    char prefix[32], path[300], comm[64], stat[512];
+    uint64_t ns = 0;
+    struct dirent *de;
+    DIR *proc = opendir("/proc");
+    FILE *f;
+
+    if (!proc) {
+        return 0;
+    }
+    snprintf(prefix, sizeof(prefix), "irq/%d-", irq);
+    while ((de = readdir(proc)) != NULL) {
+        char *p;
+        unsigned long long utime, stime;
+
+        if (de->d_name[0] < '0' || de->d_name[0] > '9') {
+            continue;
+        }
+        snprintf(path, sizeof(path), "/proc/%s/comm", de->d_name);
+        f = fopen(path, "r");
+        if (!f) {
+            continue;
+        }
+        if (!fgets(comm, sizeof(comm), f) || strncmp(comm, prefix, strlen(prefix))) {
+            fclose(f);
+            continue;
+        }
+        fclose(f);
+        snprintf(path, sizeof(path), "/proc/%s/stat", de->d_name);
+        f = fopen(path, "r");
+        if (!f) {
+            continue;
+        }
+        /* utime and stime are fields 14 and 15, after the ")" ending comm */
+        if (fgets(stat, sizeof(stat), f) && (p = strrchr(stat, ')')) &&
+            sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu",
+                   &utime, &stime) == 2) {
+            ns += (utime + stime) * (1000000000ull / sysconf(_SC_CLK_TCK));
+        }
+        fclose(f);
+    }
+    closedir(proc);
+    return ns;
+}
+
+static void counters_read(unsigned int button, unsigned long *presses, unsigned long *dropped)
+{
+    char line[128], fmt[64];
+    FILE *f = fopen(COUNTERS_FILE, "r");
+
+    *presses = *dropped = 0;
+    if (!f) {
+        return;
+    }
+    snprintf(fmt, sizeof(fmt), "%s button: %%lu pressed, %%lu dropped", button_names[button]);
+    while (fgets(line, sizeof(line), f)) {
+        sscanf(line, fmt, presses, dropped);
+    }
+    fclose(f);
+}
+
+static void irq_cost_read(unsigned int button, struct irq_cost *c)
+{
+    unsigned long long user, nice, sys, idle, iowait, irq, softirq;
+    uint64_t tick_ns = 1000000000ull / sysconf(_SC_CLK_TCK);
+    FILE *f = fopen("/proc/stat", "r");
+    int n;
+
+    memset(c, 0, sizeof(*c));
+    if (f) {
+        if (fscanf(f, "cpu %llu %llu %llu %llu %llu %llu %llu",
+                   &user, &nice, &sys, &idle, &iowait, &irq, &softirq) == 7) {
+            c->irq_ns = irq * tick_ns;
+            c->softirq_ns = softirq * tick_ns;
+        }
+        fclose(f);
+    }
+    n = irq_lookup(irq_names[button], &c->irqs);
+    if (n >= 0) {
+        c->thread_ns = irq_thread_ns(n);
+    }
+    counters_read(button, &c->presses, &c->dropped);
+}
+
+/* edge_storm: edge_hz rising edges a second on one button for seconds */
+static void test_edge_storm(int fd, unsigned int button)
+{
+    char what[32];
+    struct irq_cost before, after;
+    struct latency lat;
+    struct timespec next;
+    uint64_t start, elapsed, edges = 0, held = 0, target, limit;
+    uint64_t period_ns = 1000000000ull / edge_hz;
+    unsigned int hold_every = edge_hz / 10 ? edge_hz / 10 : 1;
+    unsigned long presses;
+    unsigned int debounce_us = debounce_read();
+    double per_edge;
+    bool ok;
+    int line;
+
+    snprintf(what, sizeof(what), "edge_storm %s", button_names[button]);
+    if (!line_path[button]) {
+        tap_skip(what, "no line to drive");
+        return;
+    }
+    line = open(line_path[button], O_WRONLY);
+    if (line < 0) {
+        perror(line_path[button]);
+        tap(false, what);
+        return;
+    }
+
+    latency_reset();
+    irq_cost_read(button, &before);
+    target = (uint64_t)edge_hz * seconds;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    start = now_ns();
+    while (edges < target) {
+        bool hold = edges % hold_every == 0;
+
+        if (pwrite(line, "1", 1, 0) != 1) {
+            perror(line_path[button]);
+            break;
+        }
+        if (hold) {
+            /* Outlast the settle window (the default if unknown) so this
+                press must count */
+            usleep((debounce_us ? debounce_us : 20000) + 5000);
+        }
+        if (pwrite(line, "0", 1, 0) != 1) {
+            perror(line_path[button]);
+            break;
+        }
+        edges++;
+        if (hold) {
+            held++;
+            clock_gettime(CLOCK_MONOTONIC, &next); // Don't burst to catch up
+        }
+        next.tv_nsec += period_ns;
+        while (next.tv_nsec >= 1000000000) {
+            next.tv_nsec -= 1000000000;
+            next.tv_sec++;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+    }
+    elapsed = now_ns() - start;
+    usleep(100000); // Let the last settle window close
+    irq_cost_read(button, &after);
+    latency_read(&lat);
+    close(line);
+
+    per_edge = edges ? (double)(after.irq_ns - before.irq_ns + after.softirq_ns -
+                                before.softirq_ns + after.thread_ns - before.thread_ns) / edges : 0;
+    printf("# %s: %llu edges at %.0f Hz, %llu IRQs, %lu pressed, %lu dropped, ~%.0f ns CPU an edge\n",
+           what, (unsigned long long)edges, edges * 1e9 / elapsed,
+           (unsigned long long)(after.irqs - before.irqs), after.presses - before.presses,
+           after.dropped - before.dropped, per_edge);
+    fprintf(results, "{\"test\":\"edge_storm\",\"button\":\"%s\",\"edges\":%llu,\"held\":%llu,\"edge_hz\":%.1f,"
+            "\"irqs\":%llu,\"pressed\":%lu,\"dropped\":%lu,\"irq_ns\":%llu,\"softirq_ns\":%llu,"
+            "\"thread_ns\":%llu,\"cpu_ns_per_edge\":%.1f",
+            button_names[button], (unsigned long long)edges, (unsigned long long)held,
+            edges * 1e9 / elapsed, (unsigned long long)(after.irqs - before.irqs), after.presses - before.presses,
+            after.dropped - before.dropped, (unsigned long long)(after.irq_ns - before.irq_ns),
+            (unsigned long long)(after.softirq_ns - before.softirq_ns),
+            (unsigned long long)(after.thread_ns - before.thread_ns), per_edge);
+    json_latency(&lat);
+
+    /* Debounce lets every held press through and at most one press per
+        settle window, and the light still answers */
+    presses = after.presses - before.presses;
+    limit = debounce_us ? elapsed / 1000 / debounce_us + 1 : edges;
+    if (limit > edges) {
+        limit = edges;
+    }
+    ok = edges == target && latency_ok(what, &lat);
+    if (presses < held || presses > limit) {
+        printf("# %s: %lu presses got through, %llu to %llu expected\n", what, presses,
+               (unsigned long long)held, (unsigned long long)limit);
+        ok = false;
+    }
+    tap(ok && set_mode(fd, MYTRAFFIC_MODE_NORMAL) == 0, what);
+}
+
+/* concurrency: shared between the threads */
+static volatile bool stop;
+static struct worker {
+    pthread_t thread;
+    unsigned int id;
+    uint64_t ops, bytes, errors;
+} *workers;
+
+/* Blocking reader: one state per read from offset 0, until the next change */
+static void *reader(void *arg)
+{
+    struct worker *w = arg;
+    char buf[512];
+    int fd = open(device, O_RDONLY);
+
+    if (fd < 0) {
+        w->errors++;
+        return NULL;
+    }
+    while (!stop) {
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        ssize_t n;
+
+        if (poll(&pfd, 1, 100) <= 0) {
+            continue;
+        }
+        n = pread(fd, buf, sizeof(buf), 0);
+        if (n <= 0 || !memchr(buf, '\n', n)) {
+            w->errors++;
+            continue;
+        }
+        w->ops++;
+        w->bytes += n;
+    }
+    close(fd);
+    return NULL;
+}
+
+/* Status page sampler: every consistent snapshot must be a legal state */
+static void *sampler(void *arg)
+{
+    struct worker *w = arg;
+    const volatile struct mytraffic_shared *page;
+    int fd = open(device, O_RDONLY);
+    uint32_t seq, lamps;
+
+    if (fd < 0) {
+        w->errors++;
+        return NULL;
+    }
+    page = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED, fd, 0);
+    if (page == MAP_FAILED) {
+        w->errors++;
+        close(fd);
+        return NULL;
+    }
+    while (!stop) {
+        do {
+            seq = page->seq;
+            __sync_synchronize();
+            lamps = page->lamps;
+            __sync_synchronize();
+        } while ((seq & 1) || seq != page->seq);
+        if ((lamps & MYTRAFFIC_LAMP_RED) && (lamps & MYTRAFFIC_LAMP_GREEN)) {
+            w->errors++; // Red and green together
+        }
+        w->ops++;
+    }
+    munmap((void *)page, sysconf(_SC_PAGESIZE));
+    close(fd);
+    return NULL;
+}
+
+/* Writer 0 sweeps every rate from 0.1 to 50 Hz in 0.1 Hz steps through
+    write(); the others switch modes and press for crossings by ioctl */
+static void *writer(void *arg)
+{
+    struct worker *w = arg;
+    unsigned int rate = 100;
+    unsigned int mode = 0;
+    char buf[16];
+    int fd = open(device, O_RDWR);
+    int len;
+
+    if (fd < 0) {
+        w->errors++;
+        return NULL;
+    }
+    while (!stop) {
+        if (w->id == 0) {
+            len = snprintf(buf, sizeof(buf), "%u.%u\n", rate / 1000, rate % 1000 / 100);
+            if (write(fd, buf, len) != len) {
+                w->errors++;
+            }
+            rate = rate >= 50000 ? 100 : rate + 100;
+        } else if (w->ops % 8) {
+            /* Refused with EINVAL while the mode takes no crossing */
+            if (ioctl(fd, MYTRAFFIC_IOC_TRIGGER_PED) && errno != EBUSY && errno != EINVAL) {
+                w->errors++;
+            }
+        } else {
+            mode = (mode + 1) % 3;
+            if (set_mode(fd, mode)) {
+                w->errors++;
+            }
+        }
+        w->ops++;
+        usleep(1000);
+    }
+    set_mode(fd, MYTRAFFIC_MODE_NORMAL);
+    set_rate_mhz(fd, 1000);
+    close(fd);
+    return NULL;
+}
+
+static void test_concurrency(void)
+{
+    unsigned int nr = nr_readers + 1 + nr_writers;
+    uint64_t read_ops = 0, read_bytes = 0, samples = 0, write_ops = 0, errors = 0;
+    struct latency lat;
+    uint64_t start, elapsed;
+    unsigned int i;
+
+    workers = calloc(nr, sizeof(*workers));
+    if (!workers) {
+        tap(false, "concurrency");
+        return;
+    }
+    stop = false;
+    latency_reset();
+    start = now_ns();
+    for (i = 0; i < nr; i++) {
+        void *(*fn)(void *) = i < nr_readers ? reader : i == nr_readers ? sampler : writer;
+
+        workers[i].id = i < nr_readers ? i : i == nr_readers ? 0 : i - nr_readers - 1;
+        pthread_create(&workers[i].thread, NULL, fn, &workers[i]);
+    }
+    sleep(seconds);
+    stop = true;
+    for (i = 0; i < nr; i++) {
+        pthread_join(workers[i].thread, NULL);
+        errors += workers[i].errors;
+        if (i < nr_readers) {
+            read_ops += workers[i].ops;
+            read_bytes += workers[i].bytes;
+        } else if (i == nr_readers) {
+            samples += workers[i].ops;
+        } else {
+            write_ops += workers[i].ops;
+        }
+    }
+    elapsed = now_ns() - start;
+    latency_read(&lat);
+    free(workers);
+
+    printf("# concurrency: %u readers %.0f reads/s %.0f B/s, %.0f page samples/s, "
+           "%u writers %.0f ops/s, %llu errors\n",
+           nr_readers, read_ops * 1e9 / elapsed, read_bytes * 1e9 / elapsed,
+           samples * 1e9 / elapsed, nr_writers, write_ops * 1e9 / elapsed,
+           (unsigned long long)errors);
+    fprintf(results, "{\"test\":\"concurrency\",\"readers\":%u,\"writers\":%u,\"seconds\":%.3f,"
+            "\"reads\":%llu,\"reads_per_s\":%.1f,\"read_bytes_per_s\":%.1f,"
+            "\"page_samples_per_s\":%.1f,\"writes\":%llu,\"errors\":%llu",
+            nr_readers, nr_writers, elapsed / 1e9, (unsigned long long)read_ops,
+            read_ops * 1e9 / elapsed, read_bytes * 1e9 / elapsed, samples * 1e9 / elapsed,
+            (unsigned long long)write_ops, (unsigned long long)errors);
+    json_latency(&lat);
+    tap(errors == 0 && (!nr_readers || read_ops) && samples && latency_ok("concurrency", &lat),
+        "concurrency");
+}
+
+int main(int argc, char **argv)
+{
+    const char *results_path = "mytraffic_stress.json";
+    int opt, fd;
+
+    while ((opt = getopt(argc, argv, "d:t:f:r:w:T:P:L:j:")) != -1) {
+        switch (opt) {
+            case 'd': device = optarg; break;
+            case 't': seconds = strtoul(optarg, NULL, 0); break;
+            case 'f': edge_hz = strtoul(optarg, NULL, 0); break;
+            case 'r': nr_readers = strtoul(optarg, NULL, 0); break;
+            case 'w': nr_writers = strtoul(optarg, NULL, 0); break;
+            case 'T': line_path[0] = optarg; break;
+            case 'P': line_path[1] = optarg; break;
+            case 'L': max_late_us = strtoul(optarg, NULL, 0); break;
+            case 'j': results_path = optarg; break;
+            default:
+                fprintf(stderr, "usage: %s [-d device] [-t seconds] [-f edge Hz] [-r readers] "
+                        "[-w writers] [-T toggle line] [-P ped line] [-L max late us] "
+                        "[-j results file]\n", argv[0]);
+                return 2;
+        }
+    }
+    if (!seconds || !edge_hz || edge_hz > 1000000) {
+        fprintf(stderr, "%s: seconds and edge Hz (up to 1000000) must be set\n", argv[0]);
+        return 2;
+    }
+
+    printf("TAP version 13\n1..4\n");
+    fd = open(device, O_RDWR);
+    if (fd < 0) {
+        printf("Bail out! %s: %s\n", device, strerror(errno));
+        return 4; // kselftest's skip code: the module is not loaded
+    }
+    results = fopen(results_path, "w");
+    if (!results) {
+        printf("Bail out! %s: %s\n", results_path, strerror(errno));
+        return 1;
+    }
+    set_mode(fd, MYTRAFFIC_MODE_NORMAL);
+
+    test_rate_sweep(fd);
+    test_edge_storm(fd, 0);
+    test_edge_storm(fd, 1);
+    test_concurrency();
+
+    fclose(results);
+    close(fd);
+    printf("# %u failed, results in %s\n", failures, results_path);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,74 @@
+#!/bin/sh
+# run_stress.sh: load mytraffic on simulated or looped-back pins and run
+# mytraffic_stress against it. Run as root from this directory.
+#
+# By default gpio-mockup provides the pins: lines 0-2 are the lamps and 3-4
+# the toggle and pedestrian buttons, driven through debugfs. With
+# TOGGLE_OUT and PED_OUT set to output GPIOs wired to the real buttons'
+# pins (26 and 46 by default) the module is loaded with its own pins and the
+# edges are made on those outputs instead.
+#
+# Extra arguments go to mytraffic_stress, e.g. ./run_stress.sh -t 10 -f 5000
+# Exits 4, kselftest's skip, when the pins or module cannot be set up.
+
+KSFT_SKIP=4
+MODULE=${MODULE:-../mytraffic.ko}
+DEBUGFS=/sys/kernel/debug
+
+skip() {
+	echo "# SKIP: $1"
+	exit $KSFT_SKIP
+}
+
+[ "$(id -u)" = 0 ] || skip "must be run as root"
+[ -f "$MODULE" ] || skip "$MODULE not built"
+[ -x ./mytraffic_stress ] || skip "mytraffic_stress not built"
+mountpoint -q $DEBUGFS || mount -t debugfs none $DEBUGFS || skip "no debugfs"
+lsmod | grep -q '^mytraffic ' && skip "mytraffic already loaded"
+
+cleanup() {
+	rmmod mytraffic 2>/dev/null
+	if [ -n "$MOCKUP" ]; then
+		rmmod gpio-mockup 2>/dev/null
+	fi
+	for gpio in $EXPORTED; do
+		echo "$gpio" > /sys/class/gpio/unexport
+	done
+}
+trap cleanup EXIT
+
+if [ -n "$TOGGLE_OUT" ] && [ -n "$PED_OUT" ]; then
+	EXPORTED=""
+	for gpio in $TOGGLE_OUT $PED_OUT; do
+		echo "$gpio" > /sys/class/gpio/export || skip "cannot export GPIO $gpio"
+		EXPORTED="$EXPORTED $gpio"
+		echo low > /sys/class/gpio/gpio$gpio/direction
+	done
+	insmod "$MODULE" || skip "cannot load $MODULE"
+	TOGGLE_LINE=/sys/class/gpio/gpio$TOGGLE_OUT/value
+	PED_LINE=/sys/class/gpio/gpio$PED_OUT/value
+else
+	modprobe gpio-mockup gpio_mockup_ranges=-1,5 || skip "no gpio-mockup"
+	MOCKUP=1
+	CHIP=$(ls -d /sys/bus/platform/devices/gpio-mockup.0/gpiochip* 2>/dev/null | head -n 1)
+	BASE=""
+	for sys in /sys/class/gpio/gpiochip*; do
+		[ "$(cat $sys/label)" = gpio-mockup-A ] && BASE=$(cat $sys/base)
+	done
+	[ -n "$CHIP" ] && [ -n "$BASE" ] || skip "gpio-mockup made no chip"
+	insmod "$MODULE" red_gpio=$BASE yellow_gpio=$((BASE + 1)) \
+		green_gpio=$((BASE + 2)) toggle_gpio=$((BASE + 3)) \
+		ped_gpio=$((BASE + 4)) || skip "cannot load $MODULE on gpio-mockup"
+	LINES=$DEBUGFS/gpio-mockup/$(basename $CHIP)
+	TOGGLE_LINE=$LINES/3
+	PED_LINE=$LINES/4
+fi
+
+# udev makes the node; give it a moment
+for i in 1 2 3 4 5; do
+	[ -c /dev/mytraffic ] && break
+	sleep 1
+done
+[ -c /dev/mytraffic ] || skip "/dev/mytraffic did not appear"
+
+./mytraffic_stress -T "$TOGGLE_LINE" -P "$PED_LINE" "$@"